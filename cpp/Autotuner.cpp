@@ -0,0 +1,149 @@
+#include <stdio.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include "Autotuner.hpp"
+#include "OpenclCheck.hpp"
+
+static std::string deviceFileName(cl_device_id device_id)
+{
+    // Name and driver of the device, with everything but letters, digits and dots replaced
+    char name[256];
+    char driver[256];
+    checkCL(clGetDeviceInfo(device_id, CL_DEVICE_NAME, sizeof(name), name, NULL));
+    checkCL(clGetDeviceInfo(device_id, CL_DRIVER_VERSION, sizeof(driver), driver, NULL));
+    std::string file_name = std::string(name) + "_" + driver;
+    for (size_t i = 0; i < file_name.size(); i++)
+    {
+        char c = file_name[i];
+        if (!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '.'))
+        {
+            file_name[i] = '_';
+        }
+    }
+    return file_name + ".txt";
+}
+
+Autotuner::Autotuner(const char *directory, cl_device_id device_id)
+{
+    if (directory == NULL || directory[0] == '\0')
+    {
+        return;
+    }
+    if (mkdir(directory, 0755) != 0 && errno != EEXIST)
+    {
+        printf("Tuning file disabled, can't create %s\n", directory);
+        return;
+    }
+    path = std::string(directory) + "/" + deviceFileName(device_id);
+
+    // One entry per line: dims, local size x y z, then the key up to the end of the line
+    FILE *file_handle = fopen(path.c_str(), "r");
+    if (file_handle == NULL)
+    {
+        return;
+    }
+    LocalSize local;
+    char key[512];
+    while (fscanf(file_handle, "%u %zu %zu %zu %511[^\n]", &local.dims, &local.size[0], &local.size[1], &local.size[2], key) == 5)
+    {
+        if (local.dims >= 1 && local.dims <= 3)
+        {
+            best[key] = local;
+        }
+    }
+    fclose(file_handle);
+}
+
+void Autotuner::save() const
+{
+    if (path.empty())
+    {
+        return;
+    }
+
+    // Replaced whole like a program cache entry, see ProgramCache::store()
+    std::string temp_path = path + ".tmp";
+    FILE *file_handle = fopen(temp_path.c_str(), "w");
+    if (file_handle == NULL)
+    {
+        return;
+    }
+    bool written = true;
+    for (std::map<std::string, LocalSize>::const_iterator it = best.begin(); it != best.end(); ++it)
+    {
+        const LocalSize &local = it->second;
+        written = fprintf(file_handle, "%u %zu %zu %zu %s\n", local.dims, local.size[0], local.size[1], local.size[2], it->first.c_str()) > 0 && written;
+    }
+    written = fclose(file_handle) == 0 && written;
+    if (!written || rename(temp_path.c_str(), path.c_str()) != 0)
+    {
+        remove(temp_path.c_str());
+    }
+}
+
+bool Autotuner::find(const std::string &key, LocalSize *local) const
+{
+    std::map<std::string, LocalSize>::const_iterator found = best.find(key);
+    if (found == best.end())
+    {
+        return false;
+    }
+    *local = found->second;
+    return true;
+}
+
+void Autotuner::record(const std::string &key, const LocalSize &local)
+{
+    // Saved right away, the program may end with _exit()
+    best[key] = local;
+    save();
+}
+
+size_t Autotuner::size() const
+{
+    return best.size();
+}
+
+std::vector<LocalSize> Autotuner::candidates(cl_device_id device_id, cl_kernel kernel, cl_uint dims, const size_t *global)
+{
+    size_t max_group;
+    size_t multiple;
+    size_t max_items[3];
+    checkCL(clGetKernelWorkGroupInfo(kernel, device_id, CL_KERNEL_WORK_GROUP_SIZE, sizeof(max_group), &max_group, NULL));
+    checkCL(clGetKernelWorkGroupInfo(kernel, device_id, CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE, sizeof(multiple), &multiple, NULL));
+    checkCL(clGetDeviceInfo(device_id, CL_DEVICE_MAX_WORK_ITEM_SIZES, sizeof(max_items), max_items, NULL));
+
+    size_t total = 1;
+    size_t limit[3] = {1, 1, 1};
+    for (cl_uint d = 0; d < dims; d++)
+    {
+        total *= global[d];
+        // Larger than the next power of two of the range only adds idle work items
+        while (limit[d] < global[d] && limit[d] * 2 <= max_items[d])
+        {
+            limit[d] *= 2;
+        }
+    }
+
+    std::vector<LocalSize> result;
+    LocalSize runtime = {dims, {0, 0, 0}};
+    result.push_back(runtime);
+    for (size_t x = 1; x <= limit[0]; x *= 2)
+    {
+        for (size_t y = 1; y <= limit[1]; y *= 2)
+        {
+            for (size_t z = 1; z <= limit[2]; z *= 2)
+            {
+                size_t group = x * y * z;
+                // Groups below the preferred multiple waste lanes, unless one group covers the whole range
+                if (group > max_group || (group % multiple != 0 && group < total))
+                {
+                    continue;
+                }
+                LocalSize local = {dims, {x, y, z}};
+                result.push_back(local);
+            }
+        }
+    }
+    return result;
+}
@@ -0,0 +1,33 @@
+#ifndef __AUTOTUNER_H__
+#define __AUTOTUNER_H__
+
+#include <map>
+#include <string>
+#include <vector>
+#include <CL/opencl.h>
+
+struct LocalSize
+{
+    cl_uint dims;   // work dimensions
+    size_t size[3]; // local size per dimension, all 0 lets the runtime pick
+};
+
+class Autotuner // Best local size per kernel and shape, persisted in one tuning file per device
+{
+private:
+    std::map<std::string, LocalSize> best; // by kernel name and shape
+    std::string path;                      // tuning file of the device, empty when not persisted
+
+    void save() const;
+
+public:
+    Autotuner(const char *directory, cl_device_id device_id);
+    bool find(const std::string &key, LocalSize *local) const;
+    void record(const std::string &key, const LocalSize &local);
+    size_t size() const;
+
+    // Local sizes worth timing, within the kernel's work-group limit and in multiples of its preferred size
+    static std::vector<LocalSize> candidates(cl_device_id device_id, cl_kernel kernel, cl_uint dims, const size_t *global);
+};
+
+#endif
@@ -0,0 +1,120 @@
+#include "BufferPool.hpp"
+#include "OpenclCheck.hpp"
+
+BufferPool::BufferPool(cl_context context, size_t limit)
+    : context(context), limit(limit)
+{
+    stats.hits = 0;
+    stats.misses = 0;
+    stats.evictions = 0;
+    stats.bytesHeld = 0;
+    stats.bytesInUse = 0;
+}
+
+BufferPool::~BufferPool()
+{
+    trim(0);
+    for (std::map<cl_mem, Entry>::iterator it = inUse.begin(); it != inUse.end(); ++it)
+    {
+        checkCL(clReleaseMemObject(it->first));
+    }
+}
+
+size_t BufferPool::bucketSize(size_t size)
+{
+    // Round up to a power of two so that similar sizes share buffers
+    size_t bucket = 256;
+    while (bucket < size)
+    {
+        bucket <<= 1;
+    }
+    return bucket;
+}
+
+cl_mem BufferPool::acquire(size_t size, cl_mem_flags flags)
+{
+    Entry entry;
+    entry.size = bucketSize(size);
+    entry.flags = flags;
+
+    std::pair<std::multimap<Key, std::list<Entry>::iterator>::iterator,
+              std::multimap<Key, std::list<Entry>::iterator>::iterator>
+        range = idle.equal_range(Key(entry.size, flags));
+    if (range.first != range.second)
+    {
+        // Reuse the most recently returned buffer of this key
+        std::multimap<Key, std::list<Entry>::iterator>::iterator last = --range.second;
+        entry.buffer = last->second->buffer;
+        lru.erase(last->second);
+        idle.erase(last);
+        stats.hits++;
+        stats.bytesHeld -= entry.size;
+    }
+    else
+    {
+        cl_int err;
+        entry.buffer = clCreateBuffer(context, flags, entry.size, NULL, &err);
+        checkCL(err);
+        stats.misses++;
+    }
+
+    inUse[entry.buffer] = entry;
+    stats.bytesInUse += entry.size;
+    return entry.buffer;
+}
+
+void BufferPool::release(cl_mem buffer)
+{
+    std::map<cl_mem, Entry>::iterator it = inUse.find(buffer);
+    if (it == inUse.end())
+    {
+        // Not from this pool
+        checkCL(clReleaseMemObject(buffer));
+        return;
+    }
+
+    Entry entry = it->second;
+    inUse.erase(it);
+    stats.bytesInUse -= entry.size;
+
+    lru.push_front(entry);
+    idle.insert(std::make_pair(Key(entry.size, entry.flags), lru.begin()));
+    stats.bytesHeld += entry.size;
+
+    trim(limit);
+}
+
+void BufferPool::evictOldest()
+{
+    std::list<Entry>::iterator oldest = --lru.end();
+    std::pair<std::multimap<Key, std::list<Entry>::iterator>::iterator,
+              std::multimap<Key, std::list<Entry>::iterator>::iterator>
+        range = idle.equal_range(Key(oldest->size, oldest->flags));
+    for (std::multimap<Key, std::list<Entry>::iterator>::iterator it = range.first; it != range.second; ++it)
+    {
+        if (it->second == oldest)
+        {
+            idle.erase(it);
+            break;
+        }
+    }
+
+    checkCL(clReleaseMemObject(oldest->buffer));
+    stats.bytesHeld -= oldest->size;
+    stats.evictions++;
+    lru.erase(oldest);
+}
+
+void BufferPool::trim(size_t bytes)
+{
+    // Release least recently used idle buffers until the pool fits in bytes
+    while (stats.bytesHeld > bytes && !lru.empty())
+    {
+        evictOldest();
+    }
+}
+
+BufferPoolStats BufferPool::getStats() const
+{
+    return stats;
+}
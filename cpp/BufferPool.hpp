@@ -0,0 +1,49 @@
+#ifndef __BUFFER_POOL_H__
+#define __BUFFER_POOL_H__
+
+#include <list>
+#include <map>
+#include <utility>
+#include <CL/opencl.h>
+
+struct BufferPoolStats
+{
+    size_t hits;       // acquires served from the pool
+    size_t misses;     // acquires that created a new buffer
+    size_t evictions;  // idle buffers released by LRU trimming
+    size_t bytesHeld;  // bytes of idle buffers kept in the pool
+    size_t bytesInUse; // bytes of buffers handed out and not returned yet
+};
+
+class BufferPool // Recycles cl_mem objects by (size bucket, flags)
+{
+private:
+    struct Entry
+    {
+        cl_mem buffer;
+        size_t size; // bucket size in bytes
+        cl_mem_flags flags;
+    };
+    typedef std::pair<size_t, unsigned long long> Key; // (bucket size, flags)
+
+    cl_context context;
+    size_t limit; // upper bound of bytesHeld
+
+    std::list<Entry> lru;                                // idle buffers, most recently returned first
+    std::multimap<Key, std::list<Entry>::iterator> idle; // idle buffers by key
+    std::map<cl_mem, Entry> inUse;                       // buffers handed out
+    BufferPoolStats stats;
+
+    static size_t bucketSize(size_t size);
+    void evictOldest();
+
+public:
+    BufferPool(cl_context context, size_t limit);
+    ~BufferPool();
+    cl_mem acquire(size_t size, cl_mem_flags flags);
+    void release(cl_mem buffer);
+    void trim(size_t bytes);
+    BufferPoolStats getStats() const;
+};
+
+#endif
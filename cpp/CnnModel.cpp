@@ -0,0 +1,422 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <utility>
+#include "CnnModel.hpp"
+#include "OpenclCheck.hpp"
+
+CnnModel::CnnModel(OpenclClient &client, const cl_mem weights[4], int row, int col, int slot_count)
+    : client(client), row(row), col(col), planner(client.getBaseAlignment()), slots(slot_count), nextSlot(0)
+{
+    if (64 * (row / 4) * (col / 4) != 3136)
+    {
+        printf("Unsupported input size %d x %d\n", row, col);
+        _exit(1);
+    }
+    for (int i = 0; i < 4; i++)
+    {
+        this->weights[i] = weights[i];
+    }
+
+    // Both layers are 3x3 with stride 1 and padding 1 followed by ReLU and 2x2 pooling, the algorithm is picked
+    // per layer and Winograd filters are transformed once here
+    algorithms[0] = client.chooseConvAlgorithm("conv1", 1, 3, true);
+    algorithms[1] = client.chooseConvAlgorithm("conv2", 32, 3, true);
+    winogradWeights[0] = algorithms[0] == CONV_WINOGRAD ? client.registerWinogradWeight(weights[0], row, col, 1, 32) : NULL;
+    winogradWeights[1] = algorithms[1] == CONV_WINOGRAD ? client.registerWinogradWeight(weights[1], row / 2, col / 2, 32, 64) : NULL;
+    if (algorithms[0] == CONV_WINOGRAD && winogradWeights[0] == NULL)
+    {
+        algorithms[0] = CONV_DIRECT; // out of tolerance
+    }
+    if (algorithms[1] == CONV_WINOGRAD && winogradWeights[1] == NULL)
+    {
+        algorithms[1] = CONV_DIRECT;
+    }
+
+    // Steps of infer(), a tensor is alive from its first to its last step
+    // 0: upload, 1: gray, 2: conv1, 3: relu, 4: avgpool, 5: conv2, 6: relu, 7: maxpool,
+    // 8: linear1, 9: relu (in linear1's epilogue), 10: linear2, 11: readback
+    // A fused layer writes its pooled output in its conv step, the full-size output is never stored.
+    // Scratch lives for its conv step only, so conv1's and conv2's may alias
+    bool fused1 = algorithms[0] == CONV_FUSED;
+    bool fused2 = algorithms[1] == CONV_FUSED;
+    for (int i = 0; i < ACTIVATION_COUNT; i++)
+    {
+        tensors[i] = -1;
+    }
+    tensors[IMAGE] = planner.addTensor(3 * sizeof(unsigned char) * row * col, 0, 1);
+    tensors[GRAY] = planner.addTensor(sizeof(float) * row * col, 1, 2);
+    if (!fused1)
+    {
+        tensors[FIRST] = planner.addTensor(sizeof(float) * 32 * row * col, 2, 4);
+    }
+    tensors[SECOND] = planner.addTensor(sizeof(float) * 32 * (row / 2) * (col / 2), fused1 ? 2 : 4, 5);
+    if (!fused2)
+    {
+        tensors[THIRD] = planner.addTensor(sizeof(float) * 64 * (row / 2) * (col / 2), 5, 7);
+    }
+    tensors[FOURTH] = planner.addTensor(sizeof(float) * 64 * (row / 4) * (col / 4), fused2 ? 5 : 7, 8);
+    tensors[FIFTH] = planner.addTensor(sizeof(float) * 256, 8, 10);
+    tensors[SIXTH] = planner.addTensor(sizeof(float) * 10, 10, 11);
+    if (algorithms[0] == CONV_WINOGRAD)
+    {
+        tensors[CONV1_TILES] = planner.addTensor(OpenclClient::getWinogradTilesSize(row, col, 1), 2, 2);
+        tensors[CONV1_PRODUCTS] = planner.addTensor(OpenclClient::getWinogradProductsSize(row, col, 32), 2, 2);
+    }
+    if (algorithms[1] == CONV_WINOGRAD)
+    {
+        tensors[CONV2_TILES] = planner.addTensor(OpenclClient::getWinogradTilesSize(row / 2, col / 2, 32), 5, 5);
+        tensors[CONV2_PRODUCTS] = planner.addTensor(OpenclClient::getWinogradProductsSize(row / 2, col / 2, 64), 5, 5);
+    }
+    if (algorithms[0] == CONV_IM2COL)
+    {
+        tensors[CONV1_COLUMNS] = planner.addTensor(OpenclClient::getIm2colSize(row, col, 1, 3), 2, 2);
+    }
+    if (algorithms[1] == CONV_IM2COL)
+    {
+        tensors[CONV2_COLUMNS] = planner.addTensor(OpenclClient::getIm2colSize(row / 2, col / 2, 32, 3), 5, 5);
+    }
+    size_t arena_size = planner.plan();
+
+    // Page-aligned so that the device can use the host arena directly
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    arena_size = (arena_size + page_size - 1) / page_size * page_size;
+
+    // The only allocations of the model, infer() allocates nothing.
+    // Each slot lets one more inference be in flight
+    for (size_t s = 0; s < slots.size(); s++)
+    {
+        Slot &slot = slots[s];
+        void *host_arena;
+        if (posix_memalign(&host_arena, page_size, arena_size) != 0)
+        {
+            printf("Fail to allocate arena\n");
+            _exit(1);
+        }
+        slot.hostArena = (unsigned char *)host_arena;
+        if (client.isZeroCopy())
+        {
+            // Host arena is the device arena, inputs and outputs are mapped in place
+            slot.d_arena = client.createBuffer(arena_size, CL_MEM_READ_WRITE | CL_MEM_USE_HOST_PTR, slot.hostArena);
+        }
+        else
+        {
+            slot.d_arena = client.createBuffer(arena_size, CL_MEM_READ_WRITE);
+        }
+        for (int i = 0; i < ACTIVATION_COUNT; i++)
+        {
+            slot.d_activations[i] = tensors[i] < 0 ? NULL : client.createSubBuffer(slot.d_arena, planner.getOffset(tensors[i]), planner.getSize(tensors[i]));
+        }
+        slot.upload = NULL;
+        slot.done = NULL;
+    }
+}
+
+CnnModel::~CnnModel()
+{
+    for (size_t s = 0; s < slots.size(); s++)
+    {
+        Slot &slot = slots[s];
+        if (slot.upload != NULL)
+        {
+            client.wait(slot.upload);
+        }
+        if (slot.done != NULL)
+        {
+            client.wait(slot.done);
+        }
+        for (int i = 0; i < ACTIVATION_COUNT; i++)
+        {
+            if (slot.d_activations[i] != NULL)
+            {
+                client.releaseBuffer(slot.d_activations[i]);
+            }
+        }
+        client.releaseBuffer(slot.d_arena);
+        free(slot.hostArena);
+    }
+}
+
+void *CnnModel::hostActivation(Slot &slot, Activation activation)
+{
+    return slot.hostArena + planner.getOffset(tensors[activation]);
+}
+
+CnnModel::Slot &CnnModel::takeSlot()
+{
+    Slot &slot = slots[nextSlot];
+    nextSlot = (nextSlot + 1) % slots.size();
+    return slot;
+}
+
+void CnnModel::convolve(Slot &slot, int layer, Activation input, int row, int col, int inputChannel, int outputChannel, Activation output, Activation pooled)
+{
+    // Scratch and pooling of conv1 and conv2
+    static const Activation tiles[2] = {CONV1_TILES, CONV2_TILES};
+    static const Activation products[2] = {CONV1_PRODUCTS, CONV2_PRODUCTS};
+    static const Activation columns[2] = {CONV1_COLUMNS, CONV2_COLUMNS};
+    static const char *pool_layers[2] = {"pool1", "pool2"};
+    static const char *pool_kernels[2] = {"kernel_avg_pooling_3d", "kernel_max_pooling_3d"};
+    static const char *fused_kernels[2] = {"kernel_convolution_relu_avg_pool_3d", "kernel_convolution_relu_max_pool_3d"};
+
+    cl_mem filter = weights[layer];
+    if (algorithms[layer] == CONV_FUSED)
+    {
+        // Straight to the pooled output
+        client.launch(fused_kernels[layer], slot.d_activations[input], row, col, inputChannel, filter, 3, outputChannel, slot.d_activations[pooled]);
+        return;
+    }
+    if (algorithms[layer] == CONV_WINOGRAD)
+    {
+        client.launchWinograd(slot.d_activations[input], row, col, inputChannel, winogradWeights[layer], outputChannel,
+                              slot.d_activations[tiles[layer]], slot.d_activations[products[layer]], slot.d_activations[output]);
+    }
+    else if (algorithms[layer] == CONV_IM2COL)
+    {
+        client.launchIm2col(slot.d_activations[input], row, col, inputChannel, 3, outputChannel, slot.d_activations[columns[layer]]);
+        client.launch("kernel_gemm_3d", filter, outputChannel, inputChannel * 3 * 3, slot.d_activations[columns[layer]], inputChannel * 3 * 3, row * col, slot.d_activations[output]);
+    }
+    else if (algorithms[layer] == CONV_IMPLICIT_GEMM)
+    {
+        client.launch("kernel_convolution_gemm_3d", slot.d_activations[input], row, col, inputChannel, filter, 3, outputChannel, slot.d_activations[output]);
+    }
+    else
+    {
+        client.launch("kernel_convolution_3d", slot.d_activations[input], row, col, inputChannel, filter, 3, outputChannel, slot.d_activations[output]);
+    }
+    client.launch("kernel_relu", slot.d_activations[output], outputChannel * row * col, 1);
+    client.setLayer(pool_layers[layer]);
+    client.launch(pool_kernels[layer], slot.d_activations[output], row, col, 2, outputChannel, slot.d_activations[pooled]);
+}
+
+cl_event CnnModel::enqueue(Slot &slot, const unsigned char *image, float *result, cl_event *stages)
+{
+    // Staging slot may still be read by the previous upload
+    if (slot.upload != NULL)
+    {
+        client.wait(slot.upload);
+        slot.upload = NULL;
+    }
+
+    // The arena may still be used by the last inference in this slot,
+    // its readback is the last command touching it
+    cl_uint num_busy = slot.done != NULL ? 1 : 0;
+    cl_event *busy = slot.done != NULL ? &slot.done : NULL;
+
+    // Only upload of the whole chain
+    client.setLayer("input");
+    size_t image_size = planner.getSize(tensors[IMAGE]);
+    if (client.isZeroCopy())
+    {
+        // Write the image straight into device-visible memory. Mapped on the upload queue and waited for
+        // by itself, the host only waits for this slot, not for other slots' kernels ahead in the queue
+        cl_event mapped_event;
+        void *mapped = client.mapBuffer(slot.d_activations[IMAGE], image_size, CL_MAP_WRITE_INVALIDATE_REGION, CL_FALSE, num_busy, busy, &mapped_event, true);
+        client.wait(mapped_event);
+        memcpy(mapped, image, image_size);
+        client.unmapBuffer(slot.d_activations[IMAGE], mapped, 0, NULL, &slot.upload, true);
+    }
+    else
+    {
+        memcpy(hostActivation(slot, IMAGE), image, image_size);
+        client.writeBuffer(slot.d_activations[IMAGE], hostActivation(slot, IMAGE), image_size, CL_FALSE, num_busy, busy, &slot.upload);
+    }
+
+    // First kernel waits for the upload and the slot, the rest follow on the in-order queue
+    cl_event wait_list[2] = {slot.upload, slot.done};
+    cl_event first_kernel;
+    client.setLayer("gray");
+    client.launch("kernel_gray_threshold_3d", slot.d_activations[IMAGE], row, col, slot.d_activations[GRAY], 1 + num_busy, wait_list, &first_kernel);
+
+    client.setLayer("conv1");
+    convolve(slot, 0, GRAY, row, col, 1, 32, FIRST, SECOND);
+
+    client.setLayer("conv2");
+    convolve(slot, 1, SECOND, row / 2, col / 2, 32, 64, THIRD, FOURTH);
+
+    client.setLayer("linear1");
+    client.launch("kernel_gemm_3d", weights[2], 256, 3136, slot.d_activations[FOURTH], 3136, 1, slot.d_activations[FIFTH], Epilogue(EPILOGUE_RELU));
+
+    cl_event last_kernel;
+    client.setLayer("linear2");
+    client.launch("kernel_gemm_3d", weights[3], 10, 256, slot.d_activations[FIFTH], 256, 1, slot.d_activations[SIXTH], 0, NULL, &last_kernel);
+
+    // Only readback of the whole chain, result must stay valid until the returned event completes.
+    // Without result the logits stay in the slot for the caller to map
+    if (slot.done != NULL)
+    {
+        checkCL(clReleaseEvent(slot.done));
+    }
+    cl_event done = last_kernel;
+    if (result != NULL)
+    {
+        client.setLayer("output");
+        client.readBuffer(slot.d_activations[SIXTH], result, planner.getSize(tensors[SIXTH]), CL_FALSE, 1, &last_kernel, &done);
+    }
+    else
+    {
+        checkCL(clRetainEvent(last_kernel));
+    }
+    slot.done = done;
+    checkCL(clRetainEvent(done));
+
+    if (stages != NULL)
+    {
+        stages[UPLOAD] = slot.upload;
+        stages[FIRST_KERNEL] = first_kernel;
+        stages[LAST_KERNEL] = last_kernel;
+        stages[READBACK] = done;
+        checkCL(clRetainEvent(slot.upload));
+        checkCL(clRetainEvent(done));
+    }
+    else
+    {
+        checkCL(clReleaseEvent(first_kernel));
+        checkCL(clReleaseEvent(last_kernel));
+    }
+    return done;
+}
+
+cl_event CnnModel::enqueueInfer(const unsigned char *image, float *result)
+{
+    return enqueue(takeSlot(), image, result, NULL);
+}
+
+void CnnModel::infer(const unsigned char *image, float *result)
+{
+    if (!client.isZeroCopy())
+    {
+        client.wait(enqueueInfer(image, result));
+        return;
+    }
+
+    // Read the logits in place instead of copying them back
+    Slot &slot = takeSlot();
+    client.wait(enqueue(slot, image, NULL, NULL));
+    size_t result_size = planner.getSize(tensors[SIXTH]);
+    client.setLayer("output");
+    void *mapped = client.mapBuffer(slot.d_activations[SIXTH], result_size, CL_MAP_READ);
+    memcpy(result, mapped, result_size);
+    client.unmapBuffer(slot.d_activations[SIXTH], mapped);
+}
+
+typedef std::pair<unsigned long long, unsigned long long> Interval; // device timestamps [start, end)
+
+// Total length of the union of intervals
+static double unionLength(std::vector<Interval> &intervals)
+{
+    std::sort(intervals.begin(), intervals.end());
+    double length = 0;
+    unsigned long long covered = 0;
+    for (size_t i = 0; i < intervals.size(); i++)
+    {
+        unsigned long long start = std::max(intervals[i].first, covered);
+        if (intervals[i].second > start)
+        {
+            length += intervals[i].second - start;
+            covered = intervals[i].second;
+        }
+    }
+    return length;
+}
+
+void CnnModel::inferBatch(const unsigned char *const *images, int count, float *results, PipelineStats *stats)
+{
+    // Enqueue everything first, image i + 1 uploads while image i computes
+    // and image i - 1 reads back, as far as slots and queues allow
+    bool timed = stats != NULL && client.isProfiling();
+    std::vector<cl_event> stages(timed ? count * STAGE_COUNT : 0);
+    std::vector<cl_event> done(count);
+    for (int i = 0; i < count; i++)
+    {
+        done[i] = enqueue(takeSlot(), images[i], results + 10 * i, timed ? &stages[i * STAGE_COUNT] : NULL);
+    }
+    for (int i = 0; i < count; i++)
+    {
+        client.wait(done[i]);
+    }
+
+    if (stats == NULL)
+    {
+        return;
+    }
+    memset(stats, 0, sizeof(PipelineStats));
+    stats->images = count;
+    if (!timed)
+    {
+        return;
+    }
+
+    // Kernels of one image run back to back, so first to last kernel covers its compute
+    std::vector<Interval> transfer, compute, all;
+    for (int i = 0; i < count; i++)
+    {
+        cl_ulong start[STAGE_COUNT], end[STAGE_COUNT];
+        for (int j = 0; j < STAGE_COUNT; j++)
+        {
+            client.getEventTimes(stages[i * STAGE_COUNT + j], &start[j], &end[j]);
+            checkCL(clReleaseEvent(stages[i * STAGE_COUNT + j]));
+        }
+        transfer.push_back(Interval(start[UPLOAD], end[UPLOAD]));
+        transfer.push_back(Interval(start[READBACK], end[READBACK]));
+        compute.push_back(Interval(start[FIRST_KERNEL], end[LAST_KERNEL]));
+    }
+    all = transfer;
+    all.insert(all.end(), compute.begin(), compute.end());
+
+    stats->transferMs = unionLength(transfer) / 1e6;
+    stats->computeMs = unionLength(compute) / 1e6;
+    stats->overlapMs = stats->transferMs + stats->computeMs - unionLength(all) / 1e6;
+    std::sort(all.begin(), all.end());
+    unsigned long long last_end = 0;
+    for (size_t i = 0; i < all.size(); i++)
+    {
+        last_end = std::max(last_end, all[i].second);
+    }
+    stats->wallMs = (last_end - all[0].first) / 1e6;
+}
+
+const float *CnnModel::readActivation(Activation activation)
+{
+    // Valid until the next infer(), aliased tensors may be overwritten by later layers
+    if (!isPlanned(activation))
+    {
+        return NULL;
+    }
+    Slot &slot = slots[(nextSlot + slots.size() - 1) % slots.size()];
+    void *host = hostActivation(slot, activation);
+    client.sync();
+    if (client.isZeroCopy())
+    {
+        // Host arena already holds it once mapped
+        client.unmapBuffer(slot.d_activations[activation], client.mapBuffer(slot.d_activations[activation], planner.getSize(tensors[activation]), CL_MAP_READ));
+        client.sync();
+    }
+    else
+    {
+        client.readBuffer(slot.d_activations[activation], host, planner.getSize(tensors[activation]));
+    }
+    return (const float *)host;
+}
+
+bool CnnModel::isPlanned(Activation activation) const
+{
+    return tensors[activation] >= 0;
+}
+
+size_t CnnModel::getArenaSize() const
+{
+    return planner.getArenaSize();
+}
+
+size_t CnnModel::getUnplannedSize() const
+{
+    return planner.getTotalSize();
+}
+
+ConvAlgorithm CnnModel::getConvAlgorithm(int layer) const
+{
+    return algorithms[layer];
+}
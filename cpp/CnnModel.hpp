@@ -0,0 +1,94 @@
+#ifndef __CNN_MODEL_H__
+#define __CNN_MODEL_H__
+
+#include <vector>
+#include "MyOpencl.hpp"
+#include "MemoryPlanner.hpp"
+
+struct PipelineStats
+{
+    int images;
+    double wallMs;     // first upload start to last readback end
+    double transferMs; // time any upload or readback is running
+    double computeMs;  // time any kernel is running
+    double overlapMs;  // time transfers and kernels run at the same time
+};
+
+class CnnModel // OCR network whose activations stay on the device
+{
+public:
+    // Activations, planned at build time into one arena
+    enum Activation
+    {
+        IMAGE,  // (row * col) * 3, unsigned char
+        GRAY,   // 1 * row * col
+        FIRST,  // 32 * row * col, unplanned when conv1 is fused
+        SECOND, // 32 * (row / 2) * (col / 2)
+        THIRD,  // 64 * (row / 2) * (col / 2), unplanned when conv2 is fused
+        FOURTH, // 64 * (row / 4) * (col / 4)
+        FIFTH,  // 256
+        SIXTH,  // 10
+        // Winograd scratch of a conv layer, planned only when the layer runs through Winograd
+        CONV1_TILES,    // 16 * 1 * tiles
+        CONV1_PRODUCTS, // 16 * 32 * tiles
+        CONV2_TILES,    // 16 * 32 * tiles
+        CONV2_PRODUCTS, // 16 * 64 * tiles
+        // im2col scratch of a conv layer, planned only when the layer runs through im2col
+        CONV1_COLUMNS, // (1 * 3 * 3) * row * col
+        CONV2_COLUMNS, // (32 * 3 * 3) * (row / 2) * (col / 2)
+        ACTIVATION_COUNT
+    };
+
+private:
+    // Commands of one inference whose timestamps make up the pipeline stats
+    enum Stage
+    {
+        UPLOAD,
+        FIRST_KERNEL,
+        LAST_KERNEL,
+        READBACK,
+        STAGE_COUNT
+    };
+
+    struct Slot // one arena, an inference in flight uses one slot
+    {
+        cl_mem d_arena;                         // device arena
+        unsigned char *hostArena;               // host mirror of the arena, same offsets, backs d_arena in zero-copy mode
+        cl_mem d_activations[ACTIVATION_COUNT]; // sub-buffers of d_arena, NULL for unplanned tensors
+        cl_event upload;                        // upload still reading the image staging slot
+        cl_event done;                          // readback of the last inference in this slot
+    };
+
+    OpenclClient &client;
+    cl_mem weights[4];           // conv1, conv2, linear1, linear2
+    cl_mem winogradWeights[2];   // transformed conv1 and conv2, NULL unless they run through Winograd
+    ConvAlgorithm algorithms[2]; // conv1, conv2
+
+    int row, col; // input image size
+
+    MemoryPlanner planner;
+    int tensors[ACTIVATION_COUNT];
+    std::vector<Slot> slots;
+    size_t nextSlot;
+
+    void *hostActivation(Slot &slot, Activation activation);
+    Slot &takeSlot();
+    void convolve(Slot &slot, int layer, Activation input, int row, int col, int inputChannel, int outputChannel, Activation output, Activation pooled);
+    cl_event enqueue(Slot &slot, const unsigned char *image, float *result, cl_event *stages);
+
+public:
+    CnnModel(OpenclClient &client, const cl_mem weights[4], int row, int col, int slot_count = 1);
+    ~CnnModel();
+    cl_event enqueueInfer(const unsigned char *image, float *result);
+    void infer(const unsigned char *image, float *result);
+    void inferBatch(const unsigned char *const *images, int count, float *results, PipelineStats *stats = NULL);
+    // Activation of the last inference, NULL unless isPlanned(): IMAGE to SIXTH always are except FIRST and THIRD
+    // of fused conv layers, the scratch tensors only for the algorithm of their layer
+    const float *readActivation(Activation activation);
+    bool isPlanned(Activation activation) const;
+    size_t getArenaSize() const;
+    size_t getUnplannedSize() const;
+    ConvAlgorithm getConvAlgorithm(int layer) const; // 0 for conv1, 1 for conv2
+};
+
+#endif
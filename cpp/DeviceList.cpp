@@ -0,0 +1,124 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "DeviceList.hpp"
+#include "OpenclCheck.hpp"
+
+static std::string lowerCase(std::string text)
+{
+    for (size_t i = 0; i < text.size(); i++)
+    {
+        text[i] = tolower((unsigned char)text[i]);
+    }
+    return text;
+}
+
+static bool isBetter(const DeviceInfo &device, const DeviceInfo &best)
+{
+    // Peak throughput estimate, then memory
+    unsigned long long score = (unsigned long long)device.computeUnits * device.clockMhz;
+    unsigned long long best_score = (unsigned long long)best.computeUnits * best.clockMhz;
+    return score > best_score || (score == best_score && device.globalMemSize > best.globalMemSize);
+}
+
+std::vector<DeviceInfo> listDevices()
+{
+    std::vector<DeviceInfo> devices;
+
+    cl_uint platform_count = 0;
+    if (clGetPlatformIDs(0, NULL, &platform_count) != CL_SUCCESS || platform_count == 0)
+    {
+        return devices;
+    }
+    std::vector<cl_platform_id> platforms(platform_count);
+    checkCL(clGetPlatformIDs(platform_count, &platforms[0], NULL));
+
+    for (cl_uint p = 0; p < platform_count; p++)
+    {
+        char platform_name[256];
+        checkCL(clGetPlatformInfo(platforms[p], CL_PLATFORM_NAME, sizeof(platform_name), platform_name, NULL));
+
+        // A platform without devices reports CL_DEVICE_NOT_FOUND
+        cl_uint device_count = 0;
+        if (clGetDeviceIDs(platforms[p], CL_DEVICE_TYPE_ALL, 0, NULL, &device_count) != CL_SUCCESS || device_count == 0)
+        {
+            continue;
+        }
+        std::vector<cl_device_id> device_ids(device_count);
+        checkCL(clGetDeviceIDs(platforms[p], CL_DEVICE_TYPE_ALL, device_count, &device_ids[0], NULL));
+
+        for (cl_uint d = 0; d < device_count; d++)
+        {
+            DeviceInfo info;
+            char name[256];
+            info.platform = platforms[p];
+            info.device_id = device_ids[d];
+            info.platformName = platform_name;
+            checkCL(clGetDeviceInfo(device_ids[d], CL_DEVICE_NAME, sizeof(name), name, NULL));
+            info.name = name;
+            checkCL(clGetDeviceInfo(device_ids[d], CL_DEVICE_TYPE, sizeof(info.type), &info.type, NULL));
+            checkCL(clGetDeviceInfo(device_ids[d], CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(info.computeUnits), &info.computeUnits, NULL));
+            checkCL(clGetDeviceInfo(device_ids[d], CL_DEVICE_MAX_CLOCK_FREQUENCY, sizeof(info.clockMhz), &info.clockMhz, NULL));
+            checkCL(clGetDeviceInfo(device_ids[d], CL_DEVICE_GLOBAL_MEM_SIZE, sizeof(info.globalMemSize), &info.globalMemSize, NULL));
+            devices.push_back(info);
+        }
+    }
+    return devices;
+}
+
+int selectDevice(const std::vector<DeviceInfo> &devices, const char *selector)
+{
+    std::string wanted = lowerCase(selector != NULL ? selector : "");
+
+    // Index into the list
+    if (!wanted.empty() && strspn(wanted.c_str(), "0123456789") == wanted.size())
+    {
+        int index = atoi(wanted.c_str());
+        return index < (int)devices.size() ? index : -1;
+    }
+
+    cl_device_type type = 0;
+    if (wanted == "gpu")
+    {
+        type = CL_DEVICE_TYPE_GPU;
+    }
+    else if (wanted == "cpu")
+    {
+        type = CL_DEVICE_TYPE_CPU;
+    }
+    else if (wanted == "accelerator")
+    {
+        type = CL_DEVICE_TYPE_ACCELERATOR;
+    }
+
+    // Best of the devices matching the type or name, or of all of them
+    int best = -1;
+    for (size_t i = 0; i < devices.size(); i++)
+    {
+        bool matches = wanted.empty() ||
+                       (type != 0 ? (devices[i].type & type) != 0 : lowerCase(devices[i].name).find(wanted) != std::string::npos);
+        if (matches && (best < 0 || isBetter(devices[i], devices[best])))
+        {
+            best = i;
+        }
+    }
+    return best;
+}
+
+const char *deviceTypeName(cl_device_type type)
+{
+    if (type & CL_DEVICE_TYPE_GPU)
+    {
+        return "GPU";
+    }
+    if (type & CL_DEVICE_TYPE_CPU)
+    {
+        return "CPU";
+    }
+    if (type & CL_DEVICE_TYPE_ACCELERATOR)
+    {
+        return "accelerator";
+    }
+    return "other";
+}
@@ -0,0 +1,30 @@
+#ifndef __DEVICE_LIST_H__
+#define __DEVICE_LIST_H__
+
+#include <string>
+#include <vector>
+#include <CL/opencl.h>
+
+struct DeviceInfo
+{
+    cl_platform_id platform;  // platform of the device
+    cl_device_id device_id;   // device ID
+    std::string platformName; // CL_PLATFORM_NAME
+    std::string name;         // CL_DEVICE_NAME
+    cl_device_type type;      // GPU, CPU or accelerator
+    cl_uint computeUnits;     // CL_DEVICE_MAX_COMPUTE_UNITS
+    cl_uint clockMhz;         // CL_DEVICE_MAX_CLOCK_FREQUENCY
+    cl_ulong globalMemSize;   // CL_DEVICE_GLOBAL_MEM_SIZE in bytes
+};
+
+// Every device of every platform, in platform order
+std::vector<DeviceInfo> listDevices();
+
+// Index of the device matching selector, -1 if none does.
+// selector is an index into the list, a type ("gpu", "cpu", "accelerator") or part of the device name;
+// NULL or empty picks the device with the most compute units x clock, then the most memory
+int selectDevice(const std::vector<DeviceInfo> &devices, const char *selector);
+
+const char *deviceTypeName(cl_device_type type);
+
+#endif
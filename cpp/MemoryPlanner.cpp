@@ -0,0 +1,99 @@
+#include <algorithm>
+#include "MemoryPlanner.hpp"
+
+MemoryPlanner::MemoryPlanner(size_t alignment)
+    : alignment(alignment), arenaSize(0)
+{
+}
+
+int MemoryPlanner::addTensor(size_t size, int firstUse, int lastUse)
+{
+    Tensor tensor;
+    tensor.size = size;
+    tensor.firstUse = firstUse;
+    tensor.lastUse = lastUse;
+    tensor.offset = 0;
+    tensors.push_back(tensor);
+    return tensors.size() - 1;
+}
+
+static size_t alignUp(size_t value, size_t alignment)
+{
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+size_t MemoryPlanner::plan()
+{
+    // Place the biggest tensors first, each at the lowest offset
+    // that does not collide with a placed tensor alive at the same time
+    std::vector<int> order(tensors.size());
+    for (size_t i = 0; i < order.size(); i++)
+    {
+        order[i] = i;
+    }
+    std::stable_sort(order.begin(), order.end(), [this](int a, int b)
+                     { return tensors[a].size > tensors[b].size; });
+
+    std::vector<int> placed;
+    arenaSize = 0;
+    for (size_t i = 0; i < order.size(); i++)
+    {
+        Tensor &tensor = tensors[order[i]];
+
+        // Placed tensors whose lifetime overlaps, sorted by offset
+        std::vector<int> live;
+        for (size_t j = 0; j < placed.size(); j++)
+        {
+            const Tensor &other = tensors[placed[j]];
+            if (other.firstUse <= tensor.lastUse && tensor.firstUse <= other.lastUse)
+            {
+                live.push_back(placed[j]);
+            }
+        }
+        std::sort(live.begin(), live.end(), [this](int a, int b)
+                  { return tensors[a].offset < tensors[b].offset; });
+
+        // First gap big enough
+        size_t offset = 0;
+        for (size_t j = 0; j < live.size(); j++)
+        {
+            const Tensor &other = tensors[live[j]];
+            if (offset + tensor.size <= other.offset)
+            {
+                break;
+            }
+            offset = std::max(offset, alignUp(other.offset + other.size, alignment));
+        }
+
+        tensor.offset = offset;
+        arenaSize = std::max(arenaSize, offset + tensor.size);
+        placed.push_back(order[i]);
+    }
+
+    return arenaSize;
+}
+
+size_t MemoryPlanner::getOffset(int tensor) const
+{
+    return tensors[tensor].offset;
+}
+
+size_t MemoryPlanner::getSize(int tensor) const
+{
+    return tensors[tensor].size;
+}
+
+size_t MemoryPlanner::getArenaSize() const
+{
+    return arenaSize;
+}
+
+size_t MemoryPlanner::getTotalSize() const
+{
+    size_t total = 0;
+    for (size_t i = 0; i < tensors.size(); i++)
+    {
+        total += alignUp(tensors[i].size, alignment);
+    }
+    return total;
+}
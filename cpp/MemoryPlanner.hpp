@@ -0,0 +1,32 @@
+#ifndef __MEMORY_PLANNER_H__
+#define __MEMORY_PLANNER_H__
+
+#include <stddef.h>
+#include <vector>
+
+class MemoryPlanner // Packs tensors into one arena, tensors with disjoint lifetimes may alias
+{
+private:
+    struct Tensor
+    {
+        size_t size;   // bytes
+        int firstUse;  // first step reading or writing the tensor
+        int lastUse;   // last step reading or writing the tensor
+        size_t offset; // planned offset in the arena
+    };
+
+    std::vector<Tensor> tensors;
+    size_t alignment; // offset alignment in bytes
+    size_t arenaSize;
+
+public:
+    MemoryPlanner(size_t alignment);
+    int addTensor(size_t size, int firstUse, int lastUse);
+    size_t plan();
+    size_t getOffset(int tensor) const;
+    size_t getSize(int tensor) const;
+    size_t getArenaSize() const;
+    size_t getTotalSize() const; // arena size without any aliasing
+};
+
+#endif
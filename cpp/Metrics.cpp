@@ -0,0 +1,228 @@
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include "Metrics.hpp"
+#include "OpenclCheck.hpp"
+
+static const int buckets_per_octave = 4;
+static const int bucket_count = buckets_per_octave * 32 + 1; // up to 2^32 us
+
+static const char *counter_names[COUNTER_COUNT] = {
+    "bytes_uploaded", "bytes_downloaded", "buffer_allocations", "kernel_cache_hits",
+    "kernel_cache_misses", "program_builds", "program_cache_loads",
+    "variant_failures"};
+
+Histogram::Histogram()
+    : buckets(bucket_count, 0), count(0), sumMs(0), maxMs(0)
+{
+}
+
+void Histogram::add(double ms)
+{
+    // Bucket 0 holds everything below 1 us, bucket i ends at 2^(i / 4) us
+    double us = ms * 1000;
+    int index = us < 1 ? 0 : (int)ceil(buckets_per_octave * log2(us));
+    index = index < bucket_count ? index : bucket_count - 1;
+    buckets[index]++;
+    count++;
+    sumMs += ms;
+    maxMs = ms > maxMs ? ms : maxMs;
+}
+
+double Histogram::percentile(double fraction) const
+{
+    unsigned long long rank = (unsigned long long)ceil(fraction * count);
+    unsigned long long seen = 0;
+    for (int i = 0; i < bucket_count; i++)
+    {
+        seen += buckets[i];
+        if (seen >= rank && seen > 0)
+        {
+            double upper_ms = pow(2.0, (double)i / buckets_per_octave) / 1000;
+            return upper_ms < maxMs ? upper_ms : maxMs;
+        }
+    }
+    return 0;
+}
+
+unsigned long long Histogram::getCount() const
+{
+    return count;
+}
+
+double Histogram::getSumMs() const
+{
+    return sumMs;
+}
+
+double Histogram::getMaxMs() const
+{
+    return maxMs;
+}
+
+Metrics::Metrics()
+{
+    reset();
+}
+
+Metrics::~Metrics()
+{
+    for (size_t i = 0; i < pending.size(); i++)
+    {
+        checkCL(clReleaseEvent(pending[i].event));
+    }
+}
+
+void Metrics::add(MetricCounter counter, unsigned long long value)
+{
+    current.counters[counter] += value;
+}
+
+void Metrics::addBuildTime(double ms)
+{
+    current.programBuildMs += ms;
+}
+
+void Metrics::addCommand(const std::string &layer, const std::string &kernel, cl_command_queue track, cl_event event)
+{
+    Pending command = {layer, kernel, track, event};
+    checkCL(clRetainEvent(event));
+    pending.push_back(command);
+
+    // Bounded without anyone asking for a snapshot
+    if (pending.size() >= 1024)
+    {
+        harvest(false);
+    }
+}
+
+void Metrics::closeRun(Run &run)
+{
+    if (!run.layer.empty())
+    {
+        current.layers[run.layer].add((run.end - run.start) / 1e6);
+        run.layer.clear();
+    }
+}
+
+void Metrics::harvest(bool wait)
+{
+    while (!pending.empty())
+    {
+        Pending &command = pending.front();
+        cl_int status;
+        if (wait)
+        {
+            checkCL(clWaitForEvents(1, &command.event));
+        }
+        checkCL(clGetEventInfo(command.event, CL_EVENT_COMMAND_EXECUTION_STATUS, sizeof(status), &status, NULL));
+        if (status != CL_COMPLETE)
+        {
+            break;
+        }
+
+        cl_ulong start, end;
+        checkCL(clGetEventProfilingInfo(command.event, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &start, NULL));
+        checkCL(clGetEventProfilingInfo(command.event, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &end, NULL));
+        if (!command.kernel.empty())
+        {
+            current.kernels[command.kernel].add((end - start) / 1e6);
+        }
+
+        // Consecutive commands of one layer on one thread make up one run of it
+        Run &run = runs[command.track];
+        if (command.layer != run.layer)
+        {
+            closeRun(run);
+            run.layer = command.layer;
+            run.start = start;
+            run.end = end;
+        }
+        run.start = start < run.start ? start : run.start;
+        run.end = end > run.end ? end : run.end;
+
+        checkCL(clReleaseEvent(command.event));
+        pending.pop_front();
+    }
+    if (wait)
+    {
+        for (std::map<cl_command_queue, Run>::iterator it = runs.begin(); it != runs.end(); ++it)
+        {
+            closeRun(it->second);
+        }
+    }
+}
+
+const MetricsSnapshot &Metrics::snapshot() const
+{
+    return current;
+}
+
+void Metrics::reset()
+{
+    current.kernels.clear();
+    current.layers.clear();
+    memset(current.counters, 0, sizeof(current.counters));
+    current.programBuildMs = 0;
+    runs.clear();
+}
+
+bool Metrics::write(const char *path) const
+{
+    FILE *file_handle = fopen(path, "w");
+    if (file_handle == NULL)
+    {
+        return false;
+    }
+
+    const std::map<std::string, Histogram> *groups[2] = {&current.kernels, &current.layers};
+    const char *group_names[2] = {"kernel", "layer"};
+    size_t length = strlen(path);
+    if (length > 5 && strcmp(path + length - 5, ".prom") == 0)
+    {
+        for (int c = 0; c < COUNTER_COUNT; c++)
+        {
+            fprintf(file_handle, "# TYPE opencl_%s_total counter\nopencl_%s_total %llu\n", counter_names[c], counter_names[c], current.counters[c]);
+        }
+        fprintf(file_handle, "# TYPE opencl_program_build_seconds gauge\nopencl_program_build_seconds %.9f\n", current.programBuildMs / 1e3);
+        for (int g = 0; g < 2; g++)
+        {
+            fprintf(file_handle, "# TYPE opencl_%s_latency_seconds summary\n", group_names[g]);
+            for (std::map<std::string, Histogram>::const_iterator it = groups[g]->begin(); it != groups[g]->end(); ++it)
+            {
+                const char *label = group_names[g];
+                const Histogram &histogram = it->second;
+                fprintf(file_handle, "opencl_%s_latency_seconds{%s=\"%s\",quantile=\"0.5\"} %.9f\n", label, label, it->first.c_str(), histogram.percentile(0.5) / 1e3);
+                fprintf(file_handle, "opencl_%s_latency_seconds{%s=\"%s\",quantile=\"0.9\"} %.9f\n", label, label, it->first.c_str(), histogram.percentile(0.9) / 1e3);
+                fprintf(file_handle, "opencl_%s_latency_seconds{%s=\"%s\",quantile=\"0.99\"} %.9f\n", label, label, it->first.c_str(), histogram.percentile(0.99) / 1e3);
+                fprintf(file_handle, "opencl_%s_latency_seconds_sum{%s=\"%s\"} %.9f\n", label, label, it->first.c_str(), histogram.getSumMs() / 1e3);
+                fprintf(file_handle, "opencl_%s_latency_seconds_count{%s=\"%s\"} %llu\n", label, label, it->first.c_str(), histogram.getCount());
+            }
+        }
+    }
+    else
+    {
+        fprintf(file_handle, "{\n  \"counters\": {");
+        for (int c = 0; c < COUNTER_COUNT; c++)
+        {
+            fprintf(file_handle, "%s\"%s\": %llu", c > 0 ? ", " : "", counter_names[c], current.counters[c]);
+        }
+        fprintf(file_handle, "},\n  \"program_build_ms\": %.6f", current.programBuildMs);
+        for (int g = 0; g < 2; g++)
+        {
+            fprintf(file_handle, ",\n  \"%ss\": {", group_names[g]);
+            const char *separator = "\n";
+            for (std::map<std::string, Histogram>::const_iterator it = groups[g]->begin(); it != groups[g]->end(); ++it)
+            {
+                const Histogram &histogram = it->second;
+                fprintf(file_handle, "%s    \"%s\": {\"count\": %llu, \"sum_ms\": %.6f, \"max_ms\": %.6f, \"p50_ms\": %.6f, \"p90_ms\": %.6f, \"p99_ms\": %.6f}",
+                        separator, it->first.c_str(), histogram.getCount(), histogram.getSumMs(), histogram.getMaxMs(),
+                        histogram.percentile(0.5), histogram.percentile(0.9), histogram.percentile(0.99));
+                separator = ",\n";
+            }
+            fprintf(file_handle, "\n  }");
+        }
+        fprintf(file_handle, "\n}\n");
+    }
+    return fclose(file_handle) == 0;
+}
@@ -0,0 +1,86 @@
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+#include <CL/opencl.h>
+
+enum MetricCounter
+{
+    BYTES_UPLOADED,      // written to the device
+    BYTES_DOWNLOADED,    // read from the device
+    BUFFER_ALLOCATIONS,  // clCreateBuffer calls, pool hits excluded
+    KERNEL_CACHE_HITS,   // kernel lookups served from created kernels
+    KERNEL_CACHE_MISSES, // first lookups of a shape on a thread
+    PROGRAM_BUILDS,      // programs built from source
+    PROGRAM_CACHE_LOADS, // programs loaded from cached binaries
+    VARIANT_FAILURES,    // specialized builds that failed, their shapes run the generic kernels
+    COUNTER_COUNT
+};
+
+class Histogram // Latencies on a log scale, four buckets per power of two starting at 1 us
+{
+private:
+    std::vector<unsigned long long> buckets;
+    unsigned long long count;
+    double sumMs;
+    double maxMs;
+
+public:
+    Histogram();
+    void add(double ms);
+    double percentile(double fraction) const; // in ms, upper bound of the bucket holding it
+    unsigned long long getCount() const;
+    double getSumMs() const;
+    double getMaxMs() const;
+};
+
+struct MetricsSnapshot
+{
+    std::map<std::string, Histogram> kernels; // device time by kernel name and shape
+    std::map<std::string, Histogram> layers;  // first start to last end of a layer's commands
+    unsigned long long counters[COUNTER_COUNT];
+    double programBuildMs; // building or loading programs, specialized variants included
+};
+
+class Metrics // Aggregates of one client, device times come from the events of recorded commands
+{
+private:
+    struct Pending
+    {
+        std::string layer;
+        std::string kernel;     // empty for transfers
+        cl_command_queue track; // kernel queue of the enqueuing thread, its commands form runs together
+        cl_event event;
+    };
+
+    struct Run // Layer whose commands are being harvested on one thread, a change of layer closes it
+    {
+        std::string layer;
+        unsigned long long start, end;
+    };
+
+    MetricsSnapshot current;
+    std::deque<Pending> pending; // commands not yet harvested, in enqueue order
+
+    std::map<cl_command_queue, Run> runs; // open run by thread, so interleaved threads don't split runs
+
+    void closeRun(Run &run);
+
+public:
+    Metrics();
+    ~Metrics();
+    void add(MetricCounter counter, unsigned long long value);
+    void addBuildTime(double ms);
+    void addCommand(const std::string &layer, const std::string &kernel, cl_command_queue track, cl_event event);
+    // Moves finished commands into the histograms, waiting for all of them if wait is set
+    void harvest(bool wait);
+    const MetricsSnapshot &snapshot() const;
+    void reset();
+    // Prometheus text if path ends in .prom, JSON otherwise
+    bool write(const char *path) const;
+};
+
+#endif
@@ -0,0 +1,140 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <thread>
+#include "MultiDevice.hpp"
+
+MultiDeviceExecutor::MultiDeviceExecutor(const char *file_name, const OpenclOptions &options, float *const weights[4], const int weight_sizes[4], int row, int col, int slot_count)
+    : next(0), count(0)
+{
+    std::vector<DeviceInfo> devices = listDevices();
+    if (devices.empty())
+    {
+        printf("No OpenCL device found\n");
+        _exit(1);
+    }
+
+    replicas.resize(devices.size());
+    for (size_t d = 0; d < devices.size(); d++)
+    {
+        // Select by index, so every device gets exactly one client
+        char device_index[24];
+        snprintf(device_index, sizeof(device_index), "%zu", d);
+        OpenclOptions device_options = options;
+        device_options.device = device_index;
+
+        Replica &replica = replicas[d];
+        replica.client = new OpenclClient(file_name, 64, device_options);
+        for (int i = 0; i < 4; i++)
+        {
+            replica.weights[i] = replica.client->registerWeight(weights[i], weight_sizes[i]);
+        }
+        replica.model = new CnnModel(*replica.client, replica.weights, row, col, slot_count);
+        replica.imagesPerMs = 0;
+        replica.images = 0;
+    }
+}
+
+MultiDeviceExecutor::~MultiDeviceExecutor()
+{
+    for (size_t d = 0; d < replicas.size(); d++)
+    {
+        delete replicas[d].model;
+        delete replicas[d].client;
+    }
+}
+
+int MultiDeviceExecutor::takeChunk(size_t index)
+{
+    // Guided self-scheduling weighted by throughput: a device takes half of its share of what is left,
+    // so shards follow the measured speed and the tail is split finely enough to rebalance
+    double measured_sum = 0;
+    int measured = 0;
+    for (size_t d = 0; d < replicas.size(); d++)
+    {
+        if (replicas[d].imagesPerMs > 0)
+        {
+            measured_sum += replicas[d].imagesPerMs;
+            measured++;
+        }
+    }
+    // Devices without a measurement yet count as average
+    double average = measured > 0 ? measured_sum / measured : 1;
+    double total = 0;
+    for (size_t d = 0; d < replicas.size(); d++)
+    {
+        total += replicas[d].imagesPerMs > 0 ? replicas[d].imagesPerMs : average;
+    }
+    double share = (replicas[index].imagesPerMs > 0 ? replicas[index].imagesPerMs : average) / total;
+
+    int chunk = (int)((count - next) * share / 2);
+    return chunk > 0 ? chunk : 1;
+}
+
+void MultiDeviceExecutor::work(size_t index, const unsigned char *const *images, float *results)
+{
+    Replica &replica = replicas[index];
+    while (true)
+    {
+        int start, size;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (next >= count)
+            {
+                break;
+            }
+            start = next;
+            size = takeChunk(index);
+            size = size < count - start ? size : count - start;
+            next += size;
+        }
+
+        double begin = wallTimeMs();
+        replica.model->inferBatch(images + start, size, results + 10 * start);
+        double elapsed = wallTimeMs() - begin;
+
+        // Moving average, so a device that slows down (thermal, other load) gets smaller chunks
+        std::lock_guard<std::mutex> lock(mutex);
+        double rate = size / (elapsed > 1e-3 ? elapsed : 1e-3);
+        replica.imagesPerMs = replica.imagesPerMs > 0 ? 0.5 * replica.imagesPerMs + 0.5 * rate : rate;
+        replica.images += size;
+    }
+
+    // Every batch starts new threads, their queues and kernels would pile up in the client otherwise
+    replica.client->releaseThreadState();
+}
+
+void MultiDeviceExecutor::inferBatch(const unsigned char *const *images, int count, float *results)
+{
+    // Each worker drives its own client, no client is shared between threads
+    this->count = count;
+    next = 0;
+    std::vector<std::thread> workers;
+    for (size_t d = 0; d < replicas.size(); d++)
+    {
+        workers.push_back(std::thread(&MultiDeviceExecutor::work, this, d, images, results));
+    }
+    for (size_t d = 0; d < workers.size(); d++)
+    {
+        workers[d].join();
+    }
+}
+
+size_t MultiDeviceExecutor::getDeviceCount() const
+{
+    return replicas.size();
+}
+
+const DeviceInfo &MultiDeviceExecutor::getDeviceInfo(size_t index) const
+{
+    return replicas[index].client->getDeviceInfo();
+}
+
+int MultiDeviceExecutor::getImages(size_t index) const
+{
+    return replicas[index].images;
+}
+
+double MultiDeviceExecutor::getThroughput(size_t index) const
+{
+    return replicas[index].imagesPerMs;
+}
@@ -0,0 +1,45 @@
+#ifndef __MULTI_DEVICE_H__
+#define __MULTI_DEVICE_H__
+
+#include <mutex>
+#include <vector>
+#include "MyOpencl.hpp"
+#include "CnnModel.hpp"
+
+class MultiDeviceExecutor // Data-parallel inference, one model replica per OpenCL device
+{
+private:
+    struct Replica
+    {
+        OpenclClient *client;
+        cl_mem weights[4];  // copies of the weights on this device
+        CnnModel *model;
+        double imagesPerMs; // measured throughput, 0 until the first chunk finishes
+        int images;         // images inferred so far
+    };
+
+    std::vector<Replica> replicas;
+
+    // Shared by the workers of one batch
+    std::mutex mutex;
+    int next;  // first image not yet handed out
+    int count; // images in the batch
+
+    int takeChunk(size_t index);
+    void work(size_t index, const unsigned char *const *images, float *results);
+
+public:
+    // One client per device listDevices() reports, each gets its own copy of the weights
+    MultiDeviceExecutor(const char *file_name, const OpenclOptions &options, float *const weights[4], const int weight_sizes[4], int row, int col, int slot_count = 3);
+    ~MultiDeviceExecutor();
+
+    // Results land in request order, results + 10 * i belongs to images[i]
+    void inferBatch(const unsigned char *const *images, int count, float *results);
+
+    size_t getDeviceCount() const;
+    const DeviceInfo &getDeviceInfo(size_t index) const;
+    int getImages(size_t index) const;
+    double getThroughput(size_t index) const;
+};
+
+#endif
@@ -1,22 +1,160 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
-#include <time.h>
+#include <math.h>
 #include <unistd.h>
+#include <atomic>
 #include "MyOpencl.hpp"
+#include "OpenclCheck.hpp"
 
-#define checkCL(expression)                                                  \
-    {                                                                        \
-        cl_int cl_err = (expression);                                        \
-        if (cl_err < 0 && cl_err > -64)                                      \
-        {                                                                    \
-            printf("Error on line %d (error code: %d)\n", __LINE__, cl_err); \
-            _exit(0);                                                        \
-        }                                                                    \
+OpenclOptions::OpenclOptions()
+    : poolLimit(64 << 20), transferQueues(false), profiling(false), zeroCopy(ZERO_COPY_AUTO),
+      programCacheDir("program_cache"), specialize(true), tiledConvolution(true), winograd(true),
+      fusedConvolution(false), convAlgorithms(NULL), autotune(false), tuningDir("tuning"), device(NULL),
+      profileFile(NULL), traceFile(NULL), metrics(false), metricsFile(NULL)
+{
+}
+
+Epilogue::Epilogue(EpilogueActivation activation, cl_mem bias, float scale)
+    : bias(bias), scale(scale), activation(activation)
+{
+}
+
+void OpenclOptions::loadEnvironment()
+{
+    // OPENCL_ZERO_COPY=0/1 forces the copy or the mapped path, e.g. to test on a CPU runtime
+    const char *zero_copy = getenv("OPENCL_ZERO_COPY");
+    if (zero_copy != NULL)
+    {
+        zeroCopy = atoi(zero_copy) ? ZERO_COPY_ON : ZERO_COPY_OFF;
+    }
+
+    // OPENCL_PROGRAM_CACHE=<dir> moves the program cache, an empty value disables it
+    const char *program_cache = getenv("OPENCL_PROGRAM_CACHE");
+    if (program_cache != NULL)
+    {
+        programCacheDir = program_cache[0] != '\0' ? program_cache : NULL;
+    }
+
+    // OPENCL_SPECIALIZE=0 runs the generic kernels only
+    const char *specialize_env = getenv("OPENCL_SPECIALIZE");
+    if (specialize_env != NULL)
+    {
+        specialize = atoi(specialize_env) != 0;
+    }
+
+    // OPENCL_TILED_CONV=0 keeps convolutions out of local memory
+    const char *tiled_conv = getenv("OPENCL_TILED_CONV");
+    if (tiled_conv != NULL)
+    {
+        tiledConvolution = atoi(tiled_conv) != 0;
+    }
+
+    // OPENCL_WINOGRAD=0 runs 3x3 convolutions directly
+    const char *winograd_env = getenv("OPENCL_WINOGRAD");
+    if (winograd_env != NULL)
+    {
+        winograd = atoi(winograd_env) != 0;
+    }
+
+    // OPENCL_FUSED_CONV=1 fuses ReLU and pooling into the direct convolution of pooled layers. It saves the
+    // full-size output but gives up the tiled, Winograd and GEMM paths, so it stays opt-in until measured faster
+    const char *fused_conv = getenv("OPENCL_FUSED_CONV");
+    if (fused_conv != NULL)
+    {
+        fusedConvolution = atoi(fused_conv) != 0;
+    }
+
+    // OPENCL_CONV_ALGORITHMS=conv1=direct,conv2=implicit_gemm overrides the algorithm of named conv layers,
+    // one of direct, winograd, im2col, implicit_gemm and fused each
+    const char *conv_algorithms = getenv("OPENCL_CONV_ALGORITHMS");
+    if (conv_algorithms != NULL)
+    {
+        convAlgorithms = conv_algorithms[0] != '\0' ? conv_algorithms : NULL;
+    }
+
+    // OPENCL_AUTOTUNE=1 tunes local sizes, OPENCL_TUNING_DIR=<dir> moves the tuning files, empty keeps them in memory
+    const char *autotune_env = getenv("OPENCL_AUTOTUNE");
+    if (autotune_env != NULL)
+    {
+        autotune = atoi(autotune_env) != 0;
+    }
+    const char *tuning_dir = getenv("OPENCL_TUNING_DIR");
+    if (tuning_dir != NULL)
+    {
+        tuningDir = tuning_dir[0] != '\0' ? tuning_dir : NULL;
+    }
+
+    // OPENCL_DEVICE=<index|gpu|cpu|accelerator|name> picks the device, see selectDevice()
+    const char *device_env = getenv("OPENCL_DEVICE");
+    if (device_env != NULL)
+    {
+        device = device_env;
+    }
+
+    // OPENCL_PROFILE=<file> writes device timings of every command, CSV per layer if it ends in .csv, JSON otherwise
+    const char *profile_file = getenv("OPENCL_PROFILE");
+    if (profile_file != NULL && profile_file[0] != '\0')
+    {
+        profileFile = profile_file;
     }
 
-OpenclClient::OpenclClient(const char *file_name, size_t localSize)
-    : kernel_file_name(file_name), localSize(localSize)
+    // OPENCL_TRACE=<file> writes a Chrome trace of host calls and device commands
+    const char *trace_file = getenv("OPENCL_TRACE");
+    if (trace_file != NULL && trace_file[0] != '\0')
+    {
+        traceFile = trace_file;
+    }
+
+    // OPENCL_METRICS=<file> aggregates metrics and writes them, Prometheus text if it ends in .prom, JSON otherwise
+    const char *metrics_file = getenv("OPENCL_METRICS");
+    if (metrics_file != NULL && metrics_file[0] != '\0')
+    {
+        metrics = true;
+        metricsFile = metrics_file;
+    }
+}
+
+static bool isRange3d(const char *kernel_name)
+{
+    // Kernels named *_3d take x = column, y = row, z = channel instead of a flat range
+    size_t length = strlen(kernel_name);
+    return length > 3 && strcmp(kernel_name + length - 3, "_3d") == 0;
+}
+
+// CONV_TILE_MAX_FILTER of kernel_convolution_tiled_3d in Project.cl
+static const int tiled_max_filter = 3;
+
+// GEMM_TILE and GEMM_BLOCK of kernel_gemm_3d in Project.cl
+static const int gemm_tile = 32;
+static const int gemm_block = 4;
+
+// GEMV_GROUP of kernel_gemv in Project.cl
+static const int gemv_group = 64;
+
+// Inner dimension inputChannel * filterSize^2 from which a convolution goes through the GEMM by default
+static const int gemm_min_depth = 64;
+
+static const char *conv_algorithm_names[CONV_ALGORITHM_COUNT] = {"direct", "winograd", "im2col", "implicit_gemm", "fused"};
+
+static void gemmRange(int rows, int cols, size_t *global)
+{
+    // Whole tiles of a rows x cols result, a work-item per GEMM_BLOCK x GEMM_BLOCK
+    global[0] = (size_t)(cols + gemm_tile - 1) / gemm_tile * (gemm_tile / gemm_block);
+    global[1] = (size_t)(rows + gemm_tile - 1) / gemm_tile * (gemm_tile / gemm_block);
+    global[2] = 1;
+}
+
+// Never reused, unlike the address of a deleted client
+static std::atomic<unsigned long long> next_instance_id(1);
+
+OpenclClient::OpenclClient(const char *file_name, size_t localSize, const OpenclOptions &options)
+    : transferQueues(options.transferQueues),
+      profiling(options.profiling || options.profileFile != NULL || options.traceFile != NULL || options.metrics),
+      metrics(options.metrics ? new Metrics() : NULL), specialize(options.specialize), winograd(options.winograd), kernel_file_name(file_name), localSize(localSize),
+      autotune(options.autotune), instanceId(next_instance_id++)
 {
+    cl_int err;
     FILE *file_handle = fopen(file_name, "r");
     if (file_handle == NULL)
     {
@@ -33,101 +171,789 @@ OpenclClient::OpenclClient(const char *file_name, size_t localSize)
     fread(kernel_file_buffer, sizeof(char), kernel_file_size, file_handle);
     fclose(file_handle);
 
-    // Bind to platform
-    checkCL(clGetPlatformIDs(1, &cpPlatform, NULL));
+    // Pick the device among all platforms, CPU runtimes included
+    std::vector<DeviceInfo> devices = listDevices();
+    int selected = selectDevice(devices, options.device);
+    if (selected < 0)
+    {
+        if (devices.empty())
+        {
+            printf("No OpenCL device found\n");
+        }
+        else
+        {
+            printf("No OpenCL device matches %s\n", options.device);
+        }
+        _exit(1);
+    }
+    deviceInfo = devices[selected];
+    cpPlatform = deviceInfo.platform;
+    device_id = deviceInfo.device_id;
+
+    // Create a context
+    context = clCreateContext(0, 1, &device_id, NULL, NULL, &err);
+
+    // Map instead of copying when host and device share memory (Mali, CPU runtimes)
+    cl_bool unified_memory = CL_FALSE;
+    checkCL(clGetDeviceInfo(device_id, CL_DEVICE_HOST_UNIFIED_MEMORY, sizeof(unified_memory), &unified_memory, NULL));
+    zeroCopy = options.zeroCopy == ZERO_COPY_ON || (options.zeroCopy == ZERO_COPY_AUTO && unified_memory);
+
+    // Build the program executable, or load it from the binary cache
+    programCache = new ProgramCache(options.programCacheDir);
+    double build_start = wallTimeMs();
+    program = programCache->build(context, device_id, kernel_file_buffer, kernel_file_size, NULL, &programFromCache);
+    programLoadMs = wallTimeMs() - build_start;
+    countMetric(programFromCache ? PROGRAM_CACHE_LOADS : PROGRAM_BUILDS, 1);
+    if (metrics != NULL)
+    {
+        metrics->addBuildTime(programLoadMs);
+    }
+    kernelSource.assign(kernel_file_buffer, kernel_file_size);
+    delete[] kernel_file_buffer;
+    if (program == NULL)
+    {
+        _exit(1);
+    }
+
+    // Queues and kernels of the constructing thread, other threads get theirs on first use
+    ThreadState *state = createThreadState();
+    threads[std::this_thread::get_id()] = state;
+
+    tiledConvolution = options.tiledConvolution && fitsDevice(state->kernels["kernel_convolution_tiled_3d"]);
+    gemm = fitsDevice(state->kernels["kernel_gemm_3d"]) && fitsDevice(state->kernels["kernel_convolution_gemm_3d"]);
+    gemv = fitsDevice(state->kernels["kernel_gemv"]);
+    fusedConvolution = options.fusedConvolution;
+    convAlgorithms = options.convAlgorithms != NULL ? options.convAlgorithms : "";
+
+    pool = new BufferPool(context, options.poolLimit);
+    tuner = new Autotuner(options.tuningDir, device_id);
+    profiler = options.profileFile != NULL || options.traceFile != NULL ? new Profiler() : NULL;
+}
+
+OpenclClient::~OpenclClient()
+{
+    // Release OpenCL resources
+    delete profiler;
+    delete metrics;
+    delete pool;
+    for (size_t i = 0; i < weights.size(); i++)
+    {
+        checkCL(clReleaseMemObject(weights[i]));
+    }
+    checkCL(clReleaseContext(context));
+    checkCL(clReleaseProgram(program));
+    for (std::map<std::thread::id, ThreadState *>::iterator it = threads.begin(); it != threads.end(); ++it)
+    {
+        destroyThreadState(it->second);
+    }
+    for (std::map<std::string, cl_program>::iterator it = specializedPrograms.begin(); it != specializedPrograms.end(); ++it)
+    {
+        if (it->second != NULL)
+        {
+            checkCL(clReleaseProgram(it->second));
+        }
+    }
+
+    delete programCache;
+    delete tuner;
+}
+
+OpenclClient::ThreadState *OpenclClient::createThreadState()
+{
+    cl_int err;
+    ThreadState *state = new ThreadState();
+    state->layer = "unlabeled";
+
+    // Create command queues
+    cl_command_queue_properties properties = profiling ? CL_QUEUE_PROFILING_ENABLE : 0;
+    state->queue = clCreateCommandQueue(context, device_id, properties, &err);
+    checkCL(err);
+    state->uploadQueue = state->queue;
+    state->downloadQueue = state->queue;
+    if (transferQueues)
+    {
+        // Uploads of the next input and readbacks of the previous result overlap kernels
+        state->uploadQueue = clCreateCommandQueue(context, device_id, properties, &err);
+        checkCL(err);
+        state->downloadQueue = clCreateCommandQueue(context, device_id, properties, &err);
+        checkCL(err);
+    }
+
+    addKernels(*state, program, "");
+    return state;
+}
+
+void OpenclClient::destroyThreadState(ThreadState *state)
+{
+    checkCL(clReleaseCommandQueue(state->queue));
+    if (state->uploadQueue != state->queue)
+    {
+        checkCL(clReleaseCommandQueue(state->uploadQueue));
+        checkCL(clReleaseCommandQueue(state->downloadQueue));
+    }
+    for (size_t i = 0; i < state->ownedKernels.size(); i++)
+    {
+        checkCL(clReleaseKernel(state->ownedKernels[i]));
+    }
+    delete state;
+}
+
+// Calls mostly come from the thread that made the previous one, the lock is only taken on a switch
+thread_local unsigned long long OpenclClient::cachedId = 0;
+thread_local OpenclClient::ThreadState *OpenclClient::cachedState = NULL;
+
+OpenclClient::ThreadState &OpenclClient::current()
+{
+    if (cachedId == instanceId)
+    {
+        return *cachedState;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    ThreadState *&state = threads[std::this_thread::get_id()];
+    if (state == NULL)
+    {
+        state = createThreadState();
+    }
+    cachedId = instanceId;
+    cachedState = state;
+    return *state;
+}
+
+void OpenclClient::releaseThreadState()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    std::map<std::thread::id, ThreadState *>::iterator found = threads.find(std::this_thread::get_id());
+    if (found == threads.end())
+    {
+        return;
+    }
+    ThreadState *state = found->second;
+    threads.erase(found);
+    if (cachedId == instanceId)
+    {
+        cachedId = 0;
+        cachedState = NULL;
+    }
+    lock.unlock();
+
+    // Commands still queued finish first, their events stay valid after the queues go
+    checkCL(clFinish(state->uploadQueue));
+    checkCL(clFinish(state->queue));
+    checkCL(clFinish(state->downloadQueue));
+    destroyThreadState(state);
+}
+
+void OpenclClient::finishAll()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    for (std::map<std::thread::id, ThreadState *>::iterator it = threads.begin(); it != threads.end(); ++it)
+    {
+        checkCL(clFinish(it->second->uploadQueue));
+        checkCL(clFinish(it->second->queue));
+        checkCL(clFinish(it->second->downloadQueue));
+    }
+}
+
+void OpenclClient::addKernels(ThreadState &state, cl_program kernel_program, const std::string &suffix)
+{
+    // Every kernel of the program at once, indexed by its name plus suffix
+    cl_uint count;
+    checkCL(clCreateKernelsInProgram(kernel_program, 0, NULL, &count));
+    std::vector<cl_kernel> created(count);
+    checkCL(clCreateKernelsInProgram(kernel_program, count, created.data(), NULL));
+    for (cl_uint i = 0; i < count; i++)
+    {
+        size_t length;
+        checkCL(clGetKernelInfo(created[i], CL_KERNEL_FUNCTION_NAME, 0, NULL, &length));
+        std::vector<char> name(length);
+        checkCL(clGetKernelInfo(created[i], CL_KERNEL_FUNCTION_NAME, length, name.data(), NULL));
+        state.kernels[std::string(name.data()) + suffix] = created[i];
+        state.ownedKernels.push_back(created[i]);
+    }
+}
+
+cl_program OpenclClient::getVariant(const char *defines)
+{
+    // One program per shape, kernels of the same shape share it, across threads too
+    std::lock_guard<std::mutex> build_lock(buildMutex);
+    std::map<std::string, cl_program>::iterator built = specializedPrograms.find(defines);
+    if (built == specializedPrograms.end())
+    {
+        bool from_cache;
+        double build_start = wallTimeMs();
+        cl_program variant = programCache->build(context, device_id, kernelSource.c_str(), kernelSource.size(), defines, &from_cache);
+        countMetric(from_cache ? PROGRAM_CACHE_LOADS : PROGRAM_BUILDS, 1);
+        if (metrics != NULL)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            metrics->addBuildTime(wallTimeMs() - build_start);
+        }
+        if (variant == NULL)
+        {
+            printf("Warning: specialized build failed (%s), this shape runs the generic kernels\n", defines);
+            countMetric(VARIANT_FAILURES, 1);
+        }
+        built = specializedPrograms.insert(std::make_pair(std::string(defines), variant)).first;
+    }
+    return built->second;
+}
+
+cl_kernel OpenclClient::getKernel(ThreadState &state, const char *kernel_name, const char *defines, const std::string &key)
+{
+    // One hash lookup on the key the launch builds anyway
+    std::unordered_map<std::string, cl_kernel>::iterator found = state.kernels.find(specialize ? key : std::string(kernel_name));
+    if (found != state.kernels.end())
+    {
+        countMetric(KERNEL_CACHE_HITS, 1);
+        return found->second;
+    }
+    countMetric(KERNEL_CACHE_MISSES, 1);
+
+    // First launch of this shape on this thread
+    cl_program variant = specialize ? getVariant(defines) : NULL;
+    if (variant != NULL)
+    {
+        addKernels(state, variant, std::string(" ") + defines);
+        found = state.kernels.find(key);
+    }
+    else
+    {
+        found = state.kernels.find(kernel_name);
+    }
+    if (found == state.kernels.end())
+    {
+        printf("No kernel %s in %s\n", kernel_name, kernel_file_name);
+        _exit(1);
+    }
+
+    // A failed variant falls back to the generic kernel, the key then points at it too
+    state.kernels[specialize ? key : std::string(kernel_name)] = found->second;
+    return found->second;
+}
+
+cl_mem OpenclClient::registerWeight(const float *weight, size_t count)
+{
+    // Upload weight once, it stays on the device until released
+    cl_int err;
+    cl_mem d_weight = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(float) * count, (void *)weight, &err);
+    checkCL(err);
+    countMetric(BUFFER_ALLOCATIONS, 1);
+    countMetric(BYTES_UPLOADED, sizeof(float) * count);
+
+    std::lock_guard<std::mutex> lock(mutex);
+    weights.push_back(d_weight);
+    return d_weight;
+}
+
+void OpenclClient::releaseWeight(cl_mem weight)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    std::map<cl_mem, cl_mem>::iterator transformed = winogradWeights.find(weight);
+    if (transformed != winogradWeights.end())
+    {
+        // Its transform goes with it
+        cl_mem winograd_weight = transformed->second;
+        winogradWeights.erase(transformed);
+        lock.unlock();
+        if (winograd_weight != NULL)
+        {
+            releaseWeight(winograd_weight);
+        }
+        lock.lock();
+    }
+    for (size_t i = 0; i < weights.size(); i++)
+    {
+        if (weights[i] == weight)
+        {
+            checkCL(clReleaseMemObject(weight));
+            weights.erase(weights.begin() + i);
+            return;
+        }
+    }
+}
+
+cl_mem OpenclClient::createBuffer(size_t size, cl_mem_flags flags, void *host_ptr)
+{
+    unsigned long long start = hostStart();
+    cl_int err;
+    cl_mem buffer = clCreateBuffer(context, flags, size, host_ptr, &err);
+    checkCL(err);
+    recordHost("clCreateBuffer", start);
+    countMetric(BUFFER_ALLOCATIONS, 1);
+    return buffer;
+}
+
+void *OpenclClient::mapBuffer(cl_mem buffer, size_t size, cl_map_flags flags, cl_bool blocking, cl_uint num_events, const cl_event *wait_list, cl_event *event, bool upload)
+{
+    // On the kernel queue, so the mapping is ordered with the kernels using the buffer,
+    // unless an upload asks not to wait behind them
+    unsigned long long start = hostStart();
+    cl_int err;
+    cl_event own;
+    ThreadState &state = current();
+    void *mapped = clEnqueueMapBuffer(upload ? state.uploadQueue : state.queue, buffer, blocking, flags, 0, size, num_events, wait_list, commandEvent(event, &own), &err);
+    checkCL(err);
+    recordCommand("map", "", size, event, &own, start);
+    return mapped;
+}
+
+void OpenclClient::unmapBuffer(cl_mem buffer, void *mapped, cl_uint num_events, const cl_event *wait_list, cl_event *event, bool upload)
+{
+    unsigned long long start = hostStart();
+    cl_event own;
+    ThreadState &state = current();
+    checkCL(clEnqueueUnmapMemObject(upload ? state.uploadQueue : state.queue, buffer, mapped, num_events, wait_list, commandEvent(event, &own)));
+    recordCommand("unmap", "", 0, event, &own, start);
+}
+
+cl_mem OpenclClient::createSubBuffer(cl_mem buffer, size_t offset, size_t size)
+{
+    unsigned long long start = hostStart();
+    cl_buffer_region region = {offset, size};
+    cl_int err;
+    cl_mem sub_buffer = clCreateSubBuffer(buffer, 0, CL_BUFFER_CREATE_TYPE_REGION, &region, &err);
+    checkCL(err);
+    recordHost("clCreateSubBuffer", start);
+    return sub_buffer;
+}
+
+size_t OpenclClient::getBaseAlignment()
+{
+    // Sub-buffer offsets must be aligned to this, reported in bits
+    cl_uint align_bits;
+    checkCL(clGetDeviceInfo(device_id, CL_DEVICE_MEM_BASE_ADDR_ALIGN, sizeof(align_bits), &align_bits, NULL));
+    return align_bits / 8;
+}
+
+void OpenclClient::releaseBuffer(cl_mem buffer)
+{
+    checkCL(clReleaseMemObject(buffer));
+}
+
+void OpenclClient::writeBuffer(cl_mem buffer, const void *data, size_t size, cl_bool blocking, cl_uint num_events, const cl_event *wait_list, cl_event *event)
+{
+    unsigned long long start = hostStart();
+    cl_event own;
+    checkCL(clEnqueueWriteBuffer(current().uploadQueue, buffer, blocking, 0, size, data, num_events, wait_list, commandEvent(event, &own)));
+    recordCommand("write", "", size, event, &own, start);
+}
+
+void OpenclClient::readBuffer(cl_mem buffer, void *data, size_t size, cl_bool blocking, cl_uint num_events, const cl_event *wait_list, cl_event *event)
+{
+    unsigned long long start = hostStart();
+    cl_event own;
+    checkCL(clEnqueueReadBuffer(current().downloadQueue, buffer, blocking, 0, size, data, num_events, wait_list, commandEvent(event, &own)));
+    recordCommand("read", "", size, event, &own, start);
+}
+
+cl_mem OpenclClient::acquireBuffer(size_t size, cl_mem_flags flags)
+{
+    // clCreateBuffer only on a pool miss
+    unsigned long long start = hostStart();
+    std::unique_lock<std::mutex> lock(mutex);
+    size_t misses = pool->getStats().misses;
+    cl_mem buffer = pool->acquire(size, flags);
+    misses = pool->getStats().misses - misses;
+    lock.unlock();
+    recordHost("acquireBuffer", start);
+    countMetric(BUFFER_ALLOCATIONS, misses);
+    return buffer;
+}
+
+void OpenclClient::recycleBuffer(cl_mem buffer)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    pool->release(buffer);
+}
+
+void OpenclClient::trimPool(size_t bytes)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    pool->trim(bytes);
+}
+
+BufferPoolStats OpenclClient::getPoolStats()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return pool->getStats();
+}
+
+void OpenclClient::sync()
+{
+    unsigned long long start = hostStart();
+    ThreadState &state = current();
+    checkCL(clFinish(state.uploadQueue));
+    checkCL(clFinish(state.queue));
+    checkCL(clFinish(state.downloadQueue));
+    recordHost("clFinish", start);
+}
+
+void OpenclClient::wait(cl_event event)
+{
+    unsigned long long start = hostStart();
+    checkCL(clWaitForEvents(1, &event));
+    checkCL(clReleaseEvent(event));
+    recordHost("clWaitForEvents", start);
+}
+
+bool OpenclClient::isProfiling() const
+{
+    return profiling;
+}
+
+bool OpenclClient::isZeroCopy() const
+{
+    return zeroCopy;
+}
+
+double OpenclClient::getProgramLoadMs() const
+{
+    return programLoadMs;
+}
+
+bool OpenclClient::isProgramFromCache() const
+{
+    return programFromCache;
+}
+
+size_t OpenclClient::getTunedCount()
+{
+    std::lock_guard<std::mutex> lock(buildMutex);
+    return tuner->size();
+}
+
+size_t OpenclClient::getFailedVariantCount()
+{
+    std::lock_guard<std::mutex> lock(buildMutex);
+    size_t failed = 0;
+    for (std::map<std::string, cl_program>::const_iterator it = specializedPrograms.begin(); it != specializedPrograms.end(); ++it)
+    {
+        failed += it->second == NULL ? 1 : 0;
+    }
+    return failed;
+}
+
+const DeviceInfo &OpenclClient::getDeviceInfo() const
+{
+    return deviceInfo;
+}
+
+void OpenclClient::getEventTimes(cl_event event, cl_ulong *start, cl_ulong *end)
+{
+    // Device timestamps in nanoseconds, needs profiling
+    checkCL(clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), start, NULL));
+    checkCL(clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), end, NULL));
+}
+
+LocalSize OpenclClient::resolveLocalSize(ThreadState &state, cl_kernel kernel, const std::string &key, cl_uint dims, const size_t *global, cl_uint num_events, const cl_event *wait_list)
+{
+    std::map<std::string, LocalSize>::iterator found = state.localSizes.find(key);
+    if (found != state.localSizes.end())
+    {
+        return found->second;
+    }
+
+    // Kernels declaring reqd_work_group_size run with exactly that
+    size_t required[3];
+    checkCL(clGetKernelWorkGroupInfo(kernel, device_id, CL_KERNEL_COMPILE_WORK_GROUP_SIZE, sizeof(required), required, NULL));
+    if (required[0] != 0)
+    {
+        LocalSize local = {dims, {required[0], required[1], required[2]}};
+        state.localSizes[key] = local;
+        return local;
+    }
+
+    // The first thread to launch an untuned shape tunes it, the others then find it in the tuner
+    std::lock_guard<std::mutex> lock(buildMutex);
+    LocalSize local = {dims, {0, 0, 0}};
+    if (!tuner->find(key, &local) || local.dims != dims)
+    {
+        if (autotune)
+        {
+            // Tuning runs the kernel, so its inputs must be ready
+            if (num_events > 0)
+            {
+                checkCL(clWaitForEvents(num_events, wait_list));
+            }
+            local = tuneLocalSize(state, kernel, key, dims, global);
+        }
+        else
+        {
+            // Constructor default, 1D or as a square tile of rows and columns, within what the kernel allows
+            size_t max_group;
+            checkCL(clGetKernelWorkGroupInfo(kernel, device_id, CL_KERNEL_WORK_GROUP_SIZE, sizeof(max_group), &max_group, NULL));
+            local.dims = dims;
+            local.size[0] = localSize;
+            local.size[1] = local.size[2] = 1;
+            if (dims > 1)
+            {
+                while (local.size[0] > local.size[1])
+                {
+                    local.size[0] /= 2;
+                    local.size[1] *= 2;
+                }
+            }
+            while (local.size[0] * local.size[1] > max_group)
+            {
+                local.size[local.size[1] > local.size[0] ? 1 : 0] /= 2;
+            }
+        }
+    }
+    state.localSizes[key] = local;
+    return local;
+}
+
+LocalSize OpenclClient::tuneLocalSize(ThreadState &state, cl_kernel kernel, const std::string &key, cl_uint dims, const size_t *global)
+{
+    std::vector<LocalSize> candidates = Autotuner::candidates(device_id, kernel, dims, global);
+    LocalSize best = candidates[0];
+    double best_ms = -1;
+    for (size_t i = 0; i < candidates.size(); i++)
+    {
+        const LocalSize &local = candidates[i];
+        size_t padded[3];
+        for (cl_uint d = 0; d < dims; d++)
+        {
+            padded[d] = local.size[d] == 0 ? global[d] : (global[d] + local.size[d] - 1) / local.size[d] * local.size[d];
+        }
+        const size_t *local_size = local.size[0] == 0 ? NULL : local.size;
+
+        // Warm up once, a size the driver refuses (registers, local memory) is skipped
+        if (clEnqueueNDRangeKernel(state.queue, kernel, dims, NULL, padded, local_size, 0, NULL, NULL) != CL_SUCCESS ||
+            clFinish(state.queue) != CL_SUCCESS)
+        {
+            continue;
+        }
+        double elapsed_ms = -1;
+        for (int run = 0; run < 5; run++)
+        {
+            double start = wallTimeMs();
+            checkCL(clEnqueueNDRangeKernel(state.queue, kernel, dims, NULL, padded, local_size, 0, NULL, NULL));
+            checkCL(clFinish(state.queue));
+            double run_ms = wallTimeMs() - start;
+            elapsed_ms = elapsed_ms < 0 || run_ms < elapsed_ms ? run_ms : elapsed_ms;
+        }
+        if (best_ms < 0 || elapsed_ms < best_ms)
+        {
+            best = local;
+            best_ms = elapsed_ms;
+        }
+    }
+
+    printf("Tuned %s: %zu x %zu x %zu (%lf ms, %zu candidates)\n", key.c_str(), best.size[0], best.size[1], best.size[2], best_ms, candidates.size());
+    tuner->record(key, best);
+    return best;
+}
+
+cl_event *OpenclClient::commandEvent(cl_event *event, cl_event *own)
+{
+    // Recording needs an event even when the caller wants none
+    return event != NULL || (profiler == NULL && metrics == NULL) ? event : own;
+}
+
+void OpenclClient::countMetric(MetricCounter counter, unsigned long long value)
+{
+    if (metrics != NULL)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        metrics->add(counter, value);
+    }
+}
+
+unsigned long long OpenclClient::hostStart() const
+{
+    // Clock is only read when recording
+    return profiler != NULL ? Profiler::hostNs() : 0;
+}
+
+void OpenclClient::recordHost(const char *name, unsigned long long start)
+{
+    if (profiler != NULL)
+    {
+        unsigned long long end = Profiler::hostNs();
+        const std::string &layer = current().layer;
+        std::lock_guard<std::mutex> lock(mutex);
+        profiler->recordHost(layer, name, start, end);
+    }
+}
 
-    // Get ID for the device
-    checkCL(clGetDeviceIDs(cpPlatform, CL_DEVICE_TYPE_GPU, 1, &device_id, NULL));
+void OpenclClient::recordCommand(const char *type, const std::string &name, size_t bytes, cl_event *event, cl_event *own, unsigned long long start)
+{
+    // Looked up before locking, current() may take the lock itself
+    const ThreadState &state = current();
+    const std::string &layer = state.layer;
+    if (metrics != NULL)
+    {
+        bool kernel = strcmp(type, "kernel") == 0;
+        std::unique_lock<std::mutex> lock(mutex);
+        metrics->addCommand(layer, kernel ? name : std::string(), state.queue, event != NULL ? *event : *own);
+        metrics->add(BYTES_UPLOADED, strcmp(type, "write") == 0 ? bytes : 0);
+        metrics->add(BYTES_DOWNLOADED, strcmp(type, "read") == 0 ? bytes : 0);
+        lock.unlock();
+        if (profiler == NULL && event == NULL)
+        {
+            checkCL(clReleaseEvent(*own));
+        }
+    }
+    if (profiler == NULL)
+    {
+        return;
+    }
+    const char *call = strcmp(type, "kernel") == 0  ? "clEnqueueNDRangeKernel"
+                       : strcmp(type, "write") == 0 ? "clEnqueueWriteBuffer"
+                       : strcmp(type, "read") == 0  ? "clEnqueueReadBuffer"
+                       : strcmp(type, "map") == 0   ? "clEnqueueMapBuffer"
+                                                    : "clEnqueueUnmapMemObject";
+    recordHost(call, start);
+    std::unique_lock<std::mutex> lock(mutex);
+    profiler->record(layer, type, name, bytes, event != NULL ? *event : *own);
+    lock.unlock();
+    if (event == NULL)
+    {
+        checkCL(clReleaseEvent(*own));
+    }
+}
 
-    // Create a context
-    context = clCreateContext(0, 1, &device_id, NULL, NULL, &err);
+void OpenclClient::printKernelTime(cl_event executed)
+{
+    // Device start to end of the kernel alone, transfers and host overhead excluded
+    if (!profiling)
+    {
+        printf("GPUtime: unknown, profiling is off\n");
+        return;
+    }
+    cl_ulong start, end;
+    getEventTimes(executed, &start, &end);
+    printf("GPUtime: %lf ms\n", (end - start) / 1e6);
+}
 
-    // Create a command queue
-    queue = clCreateCommandQueue(context, device_id, 0, &err);
-    checkCL(err);
+void OpenclClient::setLayer(const char *name)
+{
+    current().layer = name;
+}
 
-    // Create the compute program from the source buffer
-    program = clCreateProgramWithSource(context, 1, (const char **)&kernel_file_buffer, &kernel_file_size, &err);
-    checkCL(err);
-    delete[] kernel_file_buffer;
+bool OpenclClient::writeProfile(const char *path)
+{
+    if (profiler == NULL)
+    {
+        return false;
+    }
+    finishAll();
+    std::lock_guard<std::mutex> lock(mutex);
+    return profiler->write(path);
+}
 
-    // Build the program executable
-    err = clBuildProgram(program, 0, NULL, NULL, NULL, NULL);
-    if (err != CL_SUCCESS)
+bool OpenclClient::writeTrace(const char *path)
+{
+    if (profiler == NULL)
     {
-        size_t log_size;
-        clGetProgramBuildInfo(program, device_id, CL_PROGRAM_BUILD_LOG, 0, NULL, &log_size);
-        char *file_log = new char[log_size];
-        clGetProgramBuildInfo(program, device_id, CL_PROGRAM_BUILD_LOG, log_size, file_log, NULL);
-        printf("%s\n", file_log);
-        delete[] file_log;
-        _exit(1);
+        return false;
     }
+    finishAll();
+    std::lock_guard<std::mutex> lock(mutex);
+    return profiler->writeTrace(path);
+}
 
-    kernels = new cl_kernel[10];
-    kernel_names = new const char *[10];
-    kernel_count = 0;
+MetricsSnapshot OpenclClient::getMetrics()
+{
+    if (metrics == NULL)
+    {
+        MetricsSnapshot empty;
+        memset(empty.counters, 0, sizeof(empty.counters));
+        empty.programBuildMs = 0;
+        return empty;
+    }
+    finishAll();
+    std::lock_guard<std::mutex> lock(mutex);
+    metrics->harvest(true);
+    return metrics->snapshot();
 }
 
-OpenclClient::~OpenclClient()
+void OpenclClient::resetMetrics()
 {
-    // Release OpenCL resources
-    checkCL(clReleaseContext(context));
-    checkCL(clReleaseProgram(program));
-    checkCL(clReleaseCommandQueue(queue));
-    for (int i = 0; i < kernel_count; i++)
+    if (metrics != NULL)
     {
-        checkCL(clReleaseKernel(kernels[i]));
+        std::lock_guard<std::mutex> lock(mutex);
+        metrics->harvest(false);
+        metrics->reset();
     }
+}
 
-    delete[] kernels;
-    delete[] kernel_names;
+bool OpenclClient::writeMetrics(const char *path)
+{
+    if (metrics == NULL)
+    {
+        return false;
+    }
+    finishAll();
+    std::lock_guard<std::mutex> lock(mutex);
+    metrics->harvest(true);
+    return metrics->write(path);
 }
 
-cl_kernel OpenclClient::getKernel(const char *kernel_name)
+void OpenclClient::resetProfile()
 {
-    for (int i = 0; i < kernel_count; i++)
+    if (profiler != NULL)
     {
-        if (strcmp(kernel_name, kernel_names[i]) == 0)
-        {
-            return kernels[i];
-        }
+        std::lock_guard<std::mutex> lock(mutex);
+        profiler->clear();
     }
+}
 
-    // Create the compute kernel in the program we wish to run
-    cl_kernel kernel = clCreateKernel(program, kernel_name, &err);
-    checkCL(err);
+bool OpenclClient::fitsDevice(cl_kernel kernel)
+{
+    // Tiled kernels need their whole work-group at once and their tiles in local memory
+    size_t max_group, required[3];
+    cl_ulong kernel_local, device_local;
+    checkCL(clGetKernelWorkGroupInfo(kernel, device_id, CL_KERNEL_WORK_GROUP_SIZE, sizeof(max_group), &max_group, NULL));
+    checkCL(clGetKernelWorkGroupInfo(kernel, device_id, CL_KERNEL_COMPILE_WORK_GROUP_SIZE, sizeof(required), required, NULL));
+    checkCL(clGetKernelWorkGroupInfo(kernel, device_id, CL_KERNEL_LOCAL_MEM_SIZE, sizeof(kernel_local), &kernel_local, NULL));
+    checkCL(clGetDeviceInfo(device_id, CL_DEVICE_LOCAL_MEM_SIZE, sizeof(device_local), &device_local, NULL));
+    return required[0] * required[1] * required[2] <= max_group && kernel_local <= device_local;
+}
+
+void OpenclClient::enqueueKernel(ThreadState &state, cl_kernel kernel, const std::string &key, cl_uint dims, const size_t *global, cl_uint num_events, const cl_event *wait_list, cl_event *event)
+{
+    LocalSize local = resolveLocalSize(state, kernel, key, dims, global, num_events, wait_list);
 
-    kernels[kernel_count] = kernel;
-    kernel_names[kernel_count] = kernel_name;
-    kernel_count++;
+    // Number of total work items - local size must be devisor, kernels skip the padding
+    size_t globalSize[3];
+    for (cl_uint d = 0; d < dims; d++)
+    {
+        globalSize[d] = local.size[d] == 0 ? global[d] : (global[d] + local.size[d] - 1) / local.size[d] * local.size[d];
+    }
 
-    return kernel;
+    // Execute the kernel over the entire range of the data set
+    unsigned long long start = hostStart();
+    cl_event own;
+    checkCL(clEnqueueNDRangeKernel(state.queue, kernel, dims, NULL, globalSize, local.size[0] == 0 ? NULL : local.size, num_events, wait_list, commandEvent(event, &own)));
+    recordCommand("kernel", key, 0, event, &own, start);
 }
 
-void OpenclClient::launch(const char *kernel_name, float *m, int row, int col, int inputChannel, float *filter, int filterSize, int outputChannel, float *result)
+void OpenclClient::launch(const char *kernel_name, cl_mem d_m, int row, int col, int inputChannel, cl_mem d_filter, int filterSize, int outputChannel, cl_mem d_result, cl_uint num_events, const cl_event *wait_list, cl_event *event)
 {
-    cl_kernel kernel = getKernel(kernel_name);
-    // Number of work items
-    size_t n = outputChannel * row * col;
-
-    // Number of total work items - localSize must be devisor
-    size_t grid = n / localSize + (n % localSize ? 1 : 0);
-    size_t globalSize = grid * localSize;
+    // Same arguments, the direct kernel stands in for the GEMM where the device cannot run it
+    if (!gemm && strcmp(kernel_name, "kernel_convolution_gemm_3d") == 0)
+    {
+        kernel_name = "kernel_convolution_3d";
+    }
 
-    // Create the input and output arrays in device memory for our calculation
-    cl_mem d_m = clCreateBuffer(context, CL_MEM_READ_ONLY, sizeof(float) * inputChannel * row * col, NULL, &err);
-    checkCL(err);
-    cl_mem d_filter = clCreateBuffer(context, CL_MEM_READ_ONLY, sizeof(float) * outputChannel * inputChannel * filterSize * filterSize, NULL, &err);
-    checkCL(err);
-    cl_mem d_result = clCreateBuffer(context, CL_MEM_WRITE_ONLY, sizeof(float) * outputChannel * row * col, NULL, &err);
-    checkCL(err);
+    // Same arguments and range, the tiled kernel reads global memory far less
+    if (tiledConvolution && filterSize <= tiled_max_filter && strcmp(kernel_name, "kernel_convolution_3d") == 0)
+    {
+        kernel_name = "kernel_convolution_tiled_3d";
+    }
 
-    // Write our data set into the input array in device memory
-    checkCL(clEnqueueWriteBuffer(queue, d_m, CL_TRUE, 0, sizeof(float) * inputChannel * row * col, m, 0, NULL, NULL));
-    checkCL(clEnqueueWriteBuffer(queue, d_filter, CL_TRUE, 0, sizeof(float) * outputChannel * inputChannel * filterSize * filterSize, filter, 0, NULL, NULL));
+    char defines[128];
+    snprintf(defines, sizeof(defines), "-DCONV_ROW=%d -DCONV_COL=%d -DCONV_IN_CHANNEL=%d -DCONV_FILTER_SIZE=%d -DCONV_OUT_CHANNEL=%d",
+             row, col, inputChannel, filterSize, outputChannel);
+    std::string key = std::string(kernel_name) + " " + defines;
+    ThreadState &state = current();
+    cl_kernel kernel = getKernel(state, kernel_name, defines, key);
 
     // Set the arguments to our compute kernel
+    unsigned long long args_start = hostStart();
     checkCL(clSetKernelArg(kernel, 0, sizeof(d_m), &d_m));
     checkCL(clSetKernelArg(kernel, 1, sizeof(row), &row));
     checkCL(clSetKernelArg(kernel, 2, sizeof(col), &col));
@@ -136,49 +962,59 @@ void OpenclClient::launch(const char *kernel_name, float *m, int row, int col, i
     checkCL(clSetKernelArg(kernel, 5, sizeof(filterSize), &filterSize));
     checkCL(clSetKernelArg(kernel, 6, sizeof(outputChannel), &outputChannel));
     checkCL(clSetKernelArg(kernel, 7, sizeof(d_result), &d_result));
+    recordHost("clSetKernelArg", args_start);
 
-    clock_t start = clock();
-
-    // Execute the kernel over the entire range of the data set
-    checkCL(clEnqueueNDRangeKernel(queue, kernel, 1, NULL, &globalSize, &localSize, 0, NULL, NULL));
-    // Wait for the command queue to get serviced before reading back results
-    checkCL(clFinish(queue));
-
-    // Read the results from the device
-    checkCL(clEnqueueReadBuffer(queue, d_result, CL_TRUE, 0, sizeof(float) * outputChannel * row * col, result, 0, NULL, NULL));
-
-    clock_t end = clock();
-    printf("GPUtime: %lf ms\n", 1000.0 * (end - start) / CLOCKS_PER_SEC);
-
-    // Release OpenCL object
-    checkCL(clReleaseMemObject(d_m));
-    checkCL(clReleaseMemObject(d_filter));
-    checkCL(clReleaseMemObject(d_result));
+    // Number of work items
+    if (strcmp(kernel_name, "kernel_convolution_gemm_3d") == 0)
+    {
+        size_t global[3];
+        gemmRange(outputChannel, row * col, global);
+        enqueueKernel(state, kernel, key, 3, global, num_events, wait_list, event);
+    }
+    else if (strstr(kernel_name, "_pool_3d") != NULL)
+    {
+        // Fused kernels cover the pooled output only
+        size_t global[3] = {(size_t)(col / 2), (size_t)(row / 2), (size_t)outputChannel};
+        enqueueKernel(state, kernel, key, 3, global, num_events, wait_list, event);
+    }
+    else if (isRange3d(kernel_name))
+    {
+        size_t global[3] = {(size_t)col, (size_t)row, (size_t)outputChannel};
+        enqueueKernel(state, kernel, key, 3, global, num_events, wait_list, event);
+    }
+    else
+    {
+        size_t global = outputChannel * row * col;
+        enqueueKernel(state, kernel, key, 1, &global, num_events, wait_list, event);
+    }
 }
 
-void OpenclClient::launch(const char *kernel_name, float *m1, int row1, int col1, float *m2, int row2, int col2, float *result)
+void OpenclClient::launch(const char *kernel_name, cl_mem d_m1, int row1, int col1, cl_mem d_m2, int row2, int col2, cl_mem d_result, cl_uint num_events, const cl_event *wait_list, cl_event *event)
 {
-    cl_kernel kernel = getKernel(kernel_name);
-    // Number of work items
-    size_t n = row1 * col2;
-
-    // Number of total work items - localSize must be devisor
-    size_t grid = n / localSize + (n % localSize ? 1 : 0);
-    size_t globalSize = grid * localSize;
+    launch(kernel_name, d_m1, row1, col1, d_m2, row2, col2, d_result, Epilogue(), num_events, wait_list, event);
+}
 
-    // Create the input and output arrays in device memory for our calculation
-    cl_mem d_m1 = clCreateBuffer(context, CL_MEM_READ_ONLY, sizeof(float) * row1 * col1, NULL, &err);
-    checkCL(err);
-    cl_mem d_m2 = clCreateBuffer(context, CL_MEM_READ_ONLY, sizeof(float) * row2 * col2, NULL, &err);
-    checkCL(err);
-    cl_mem d_result = clCreateBuffer(context, CL_MEM_WRITE_ONLY, sizeof(float) * row1 * col2, NULL, &err);
-    checkCL(err);
+void OpenclClient::launch(const char *kernel_name, cl_mem d_m1, int row1, int col1, cl_mem d_m2, int row2, int col2, cl_mem d_result, const Epilogue &epilogue, cl_uint num_events, const cl_event *wait_list, cl_event *event)
+{
+    // A single column leaves the GEMM tiles nearly empty, the GEMV splits each row over a work-group instead
+    bool multiply = strcmp(kernel_name, "kernel_gemm_3d") == 0 || strcmp(kernel_name, "kernel_multiply") == 0;
+    if (multiply && col2 == 1 && gemv)
+    {
+        kernel_name = "kernel_gemv";
+    }
+    else if (!gemm && strcmp(kernel_name, "kernel_gemm_3d") == 0)
+    {
+        kernel_name = "kernel_multiply";
+    }
 
-    // Write our data set into the input array in device memory
-    checkCL(clEnqueueWriteBuffer(queue, d_m1, CL_TRUE, 0, sizeof(float) * row1 * col1, m1, 0, NULL, NULL));
-    checkCL(clEnqueueWriteBuffer(queue, d_m2, CL_TRUE, 0, sizeof(float) * row2 * col2, m2, 0, NULL, NULL));
+    char defines[128];
+    snprintf(defines, sizeof(defines), "-DMUL_ROW1=%d -DMUL_COL1=%d -DMUL_ROW2=%d -DMUL_COL2=%d", row1, col1, row2, col2);
+    std::string key = std::string(kernel_name) + " " + defines;
+    ThreadState &state = current();
+    cl_kernel kernel = getKernel(state, kernel_name, defines, key);
 
     // Set the arguments to our compute kernel
+    unsigned long long args_start = hostStart();
     checkCL(clSetKernelArg(kernel, 0, sizeof(d_m1), &d_m1));
     checkCL(clSetKernelArg(kernel, 1, sizeof(row1), &row1));
     checkCL(clSetKernelArg(kernel, 2, sizeof(col1), &col1));
@@ -186,149 +1022,508 @@ void OpenclClient::launch(const char *kernel_name, float *m1, int row1, int col1
     checkCL(clSetKernelArg(kernel, 4, sizeof(row2), &row2));
     checkCL(clSetKernelArg(kernel, 5, sizeof(col2), &col2));
     checkCL(clSetKernelArg(kernel, 6, sizeof(d_result), &d_result));
+    // A NULL bias is passed as a NULL buffer
+    int activation = epilogue.activation;
+    checkCL(clSetKernelArg(kernel, 7, sizeof(cl_mem), epilogue.bias != NULL ? &epilogue.bias : NULL));
+    checkCL(clSetKernelArg(kernel, 8, sizeof(epilogue.scale), &epilogue.scale));
+    checkCL(clSetKernelArg(kernel, 9, sizeof(activation), &activation));
+    recordHost("clSetKernelArg", args_start);
+
+    // Number of work items
+    if (strcmp(kernel_name, "kernel_gemv") == 0)
+    {
+        size_t global = (size_t)row1 * gemv_group;
+        enqueueKernel(state, kernel, key, 1, &global, num_events, wait_list, event);
+    }
+    else if (isRange3d(kernel_name))
+    {
+        size_t global[3];
+        gemmRange(row1, col2, global);
+        enqueueKernel(state, kernel, key, 3, global, num_events, wait_list, event);
+    }
+    else
+    {
+        size_t global = row1 * col2;
+        enqueueKernel(state, kernel, key, 1, &global, num_events, wait_list, event);
+    }
+}
 
-    clock_t start = clock();
+void OpenclClient::launch(const char *kernel_name, cl_mem d_m, int row, int col, int filterSize, int channel, cl_mem d_result, cl_uint num_events, const cl_event *wait_list, cl_event *event)
+{
+    char defines[128];
+    snprintf(defines, sizeof(defines), "-DPOOL_ROW=%d -DPOOL_COL=%d -DPOOL_FILTER_SIZE=%d -DPOOL_CHANNEL=%d", row, col, filterSize, channel);
+    std::string key = std::string(kernel_name) + " " + defines;
+    ThreadState &state = current();
+    cl_kernel kernel = getKernel(state, kernel_name, defines, key);
 
-    // Execute the kernel over the entire range of the data set
-    checkCL(clEnqueueNDRangeKernel(queue, kernel, 1, NULL, &globalSize, &localSize, 0, NULL, NULL));
-    // Wait for the command queue to get serviced before reading back results
-    checkCL(clFinish(queue));
+    // Set the arguments to our compute kernel
+    unsigned long long args_start = hostStart();
+    checkCL(clSetKernelArg(kernel, 0, sizeof(d_m), &d_m));
+    checkCL(clSetKernelArg(kernel, 1, sizeof(row), &row));
+    checkCL(clSetKernelArg(kernel, 2, sizeof(col), &col));
+    checkCL(clSetKernelArg(kernel, 3, sizeof(filterSize), &filterSize));
+    checkCL(clSetKernelArg(kernel, 4, sizeof(channel), &channel));
+    checkCL(clSetKernelArg(kernel, 5, sizeof(d_result), &d_result));
+    recordHost("clSetKernelArg", args_start);
+
+    // Number of work items, the 3D range covers the output only
+    if (isRange3d(kernel_name))
+    {
+        size_t global[3] = {(size_t)(col / filterSize), (size_t)(row / filterSize), (size_t)channel};
+        enqueueKernel(state, kernel, key, 3, global, num_events, wait_list, event);
+    }
+    else
+    {
+        size_t global = channel * row * col;
+        enqueueKernel(state, kernel, key, 1, &global, num_events, wait_list, event);
+    }
+}
 
-    // Read the results from the device
-    checkCL(clEnqueueReadBuffer(queue, d_result, CL_TRUE, 0, sizeof(float) * row1 * col2, result, 0, NULL, NULL));
+void OpenclClient::launch(const char *kernel_name, cl_mem d_m, int row, int col, cl_uint num_events, const cl_event *wait_list, cl_event *event)
+{
+    char defines[64];
+    snprintf(defines, sizeof(defines), "-DRELU_ROW=%d -DRELU_COL=%d", row, col);
+    std::string key = std::string(kernel_name) + " " + defines;
+    ThreadState &state = current();
+    cl_kernel kernel = getKernel(state, kernel_name, defines, key);
 
-    clock_t end = clock();
-    printf("GPUtime: %lf ms\n", 1000.0 * (end - start) / CLOCKS_PER_SEC);
+    // Set the arguments to our compute kernel
+    unsigned long long args_start = hostStart();
+    checkCL(clSetKernelArg(kernel, 0, sizeof(d_m), &d_m));
+    checkCL(clSetKernelArg(kernel, 1, sizeof(row), &row));
+    checkCL(clSetKernelArg(kernel, 2, sizeof(col), &col));
+    recordHost("clSetKernelArg", args_start);
 
-    // Release OpenCL object
-    checkCL(clReleaseMemObject(d_m1));
-    checkCL(clReleaseMemObject(d_m2));
-    checkCL(clReleaseMemObject(d_result));
+    // Number of work items
+    size_t global = row * col;
+    enqueueKernel(state, kernel, key, 1, &global, num_events, wait_list, event);
 }
 
-void OpenclClient::launch(const char *kernel_name, float *m, int row, int col, int filterSize, int channel, float *result)
+void OpenclClient::launch(const char *kernel_name, cl_mem d_m, int row, int col, cl_mem d_result, cl_uint num_events, const cl_event *wait_list, cl_event *event)
 {
-    cl_kernel kernel = getKernel(kernel_name);
+    char defines[64];
+    snprintf(defines, sizeof(defines), "-DGRAY_HEIGHT=%d -DGRAY_WIDTH=%d", row, col);
+    std::string key = std::string(kernel_name) + " " + defines;
+    ThreadState &state = current();
+    cl_kernel kernel = getKernel(state, kernel_name, defines, key);
+
+    // Set the arguments to our compute kernel
+    unsigned long long args_start = hostStart();
+    checkCL(clSetKernelArg(kernel, 0, sizeof(d_m), &d_m));
+    checkCL(clSetKernelArg(kernel, 1, sizeof(row), &row));
+    checkCL(clSetKernelArg(kernel, 2, sizeof(col), &col));
+    checkCL(clSetKernelArg(kernel, 3, sizeof(d_result), &d_result));
+    recordHost("clSetKernelArg", args_start);
+
     // Number of work items
-    size_t n = channel * row * col;
+    if (isRange3d(kernel_name))
+    {
+        size_t global[3] = {(size_t)col, (size_t)row, 1};
+        enqueueKernel(state, kernel, key, 3, global, num_events, wait_list, event);
+    }
+    else
+    {
+        size_t global = row * col;
+        enqueueKernel(state, kernel, key, 1, &global, num_events, wait_list, event);
+    }
+}
+
+static int winogradTileCount(int row, int col)
+{
+    // 2x2 output tiles, the last row and column of tiles is cut at odd sizes
+    return ((row + 1) / 2) * ((col + 1) / 2);
+}
 
-    // Number of total work items - localSize must be devisor
-    size_t grid = n / localSize + (n % localSize ? 1 : 0);
-    size_t globalSize = grid * localSize;
+size_t OpenclClient::getWinogradTilesSize(int row, int col, int inputChannel)
+{
+    return sizeof(float) * 16 * inputChannel * winogradTileCount(row, col);
+}
 
-    // Create the input and output arrays in device memory for our calculation
-    cl_mem d_m = clCreateBuffer(context, CL_MEM_READ_ONLY, sizeof(float) * channel * row * col, NULL, &err);
-    checkCL(err);
-    cl_mem d_result = clCreateBuffer(context, CL_MEM_WRITE_ONLY, sizeof(float) * channel * (row / 2) * (col / 2), NULL, &err);
+size_t OpenclClient::getWinogradProductsSize(int row, int col, int outputChannel)
+{
+    return sizeof(float) * 16 * outputChannel * winogradTileCount(row, col);
+}
+
+cl_mem OpenclClient::registerWinogradWeight(cl_mem filter, int row, int col, int inputChannel, int outputChannel)
+{
+    if (!winograd)
+    {
+        return NULL;
+    }
+    std::unique_lock<std::mutex> lock(mutex);
+    std::map<cl_mem, cl_mem>::iterator found = winogradWeights.find(filter);
+    if (found != winogradWeights.end())
+    {
+        return found->second;
+    }
+    lock.unlock();
+
+    // Same shape as the direct convolution, so both share the specialized program
+    char defines[128];
+    snprintf(defines, sizeof(defines), "-DCONV_ROW=%d -DCONV_COL=%d -DCONV_IN_CHANNEL=%d -DCONV_FILTER_SIZE=3 -DCONV_OUT_CHANNEL=%d",
+             row, col, inputChannel, outputChannel);
+    std::string key = std::string("kernel_winograd_filter ") + defines;
+    ThreadState &state = current();
+    cl_kernel kernel = getKernel(state, "kernel_winograd_filter", defines, key);
+
+    cl_int err;
+    cl_mem transformed = clCreateBuffer(context, CL_MEM_READ_ONLY, sizeof(float) * 16 * inputChannel * outputChannel, NULL, &err);
     checkCL(err);
+    countMetric(BUFFER_ALLOCATIONS, 1);
+    checkCL(clSetKernelArg(kernel, 0, sizeof(filter), &filter));
+    checkCL(clSetKernelArg(kernel, 1, sizeof(inputChannel), &inputChannel));
+    checkCL(clSetKernelArg(kernel, 2, sizeof(outputChannel), &outputChannel));
+    checkCL(clSetKernelArg(kernel, 3, sizeof(transformed), &transformed));
+    size_t global = outputChannel * inputChannel;
+    cl_event executed;
+    enqueueKernel(state, kernel, key, 1, &global, 0, NULL, &executed);
+    wait(executed);
+
+    if (!checkWinograd(filter, transformed, row, col, inputChannel, outputChannel))
+    {
+        checkCL(clReleaseMemObject(transformed));
+        transformed = NULL;
+    }
 
-    // Write our data set into the input array in device memory
-    checkCL(clEnqueueWriteBuffer(queue, d_m, CL_TRUE, 0, sizeof(float) * channel * row * col, m, 0, NULL, NULL));
+    lock.lock();
+    found = winogradWeights.find(filter);
+    if (found != winogradWeights.end())
+    {
+        // Another thread transformed it meanwhile
+        if (transformed != NULL)
+        {
+            checkCL(clReleaseMemObject(transformed));
+        }
+        return found->second;
+    }
+    winogradWeights[filter] = transformed;
+    if (transformed != NULL)
+    {
+        weights.push_back(transformed);
+    }
+    return transformed;
+}
 
-    // Set the arguments to our compute kernel
+bool OpenclClient::checkWinograd(cl_mem filter, cl_mem transformed, int row, int col, int inputChannel, int outputChannel)
+{
+    // Same pseudo-random input through both paths
+    std::vector<float> input(inputChannel * row * col);
+    unsigned int seed = 1;
+    for (size_t i = 0; i < input.size(); i++)
+    {
+        seed = seed * 1103515245 + 12345;
+        input[i] = ((seed >> 16) & 0x7fff) / 32768.0f - 0.5f;
+    }
+    size_t output_size = sizeof(float) * outputChannel * row * col;
+    cl_mem d_m = acquireBuffer(sizeof(float) * input.size(), CL_MEM_READ_ONLY);
+    cl_mem d_direct = acquireBuffer(output_size, CL_MEM_READ_WRITE);
+    cl_mem d_winograd = acquireBuffer(output_size, CL_MEM_READ_WRITE);
+    cl_mem d_tiles = acquireBuffer(getWinogradTilesSize(row, col, inputChannel), CL_MEM_READ_WRITE);
+    cl_mem d_products = acquireBuffer(getWinogradProductsSize(row, col, outputChannel), CL_MEM_READ_WRITE);
+    writeBuffer(d_m, input.data(), sizeof(float) * input.size());
+
+    std::vector<float> direct(outputChannel * row * col), transformed_result(outputChannel * row * col);
+    cl_event direct_done, winograd_done;
+    launch("kernel_convolution_3d", d_m, row, col, inputChannel, filter, 3, outputChannel, d_direct, 0, NULL, &direct_done);
+    launchWinograd(d_m, row, col, inputChannel, transformed, outputChannel, d_tiles, d_products, d_winograd, 0, NULL, &winograd_done);
+    readBuffer(d_direct, direct.data(), output_size, CL_TRUE, 1, &direct_done);
+    readBuffer(d_winograd, transformed_result.data(), output_size, CL_TRUE, 1, &winograd_done);
+    checkCL(clReleaseEvent(direct_done));
+    checkCL(clReleaseEvent(winograd_done));
+    recycleBuffer(d_m);
+    recycleBuffer(d_direct);
+    recycleBuffer(d_winograd);
+    recycleBuffer(d_tiles);
+    recycleBuffer(d_products);
+
+    // Transforms round differently, relative to the largest output
+    float max_error = 0, max_value = 0;
+    for (size_t i = 0; i < direct.size(); i++)
+    {
+        max_error = fmaxf(max_error, fabsf(direct[i] - transformed_result[i]));
+        max_value = fmaxf(max_value, fabsf(direct[i]));
+    }
+    if (max_error > 1e-4f * (1 + max_value))
+    {
+        printf("Winograd off for %d x %d x %d -> %d, error %g\n", row, col, inputChannel, outputChannel, max_error);
+        return false;
+    }
+    return true;
+}
+
+void OpenclClient::launchWinograd(cl_mem d_m, int row, int col, int inputChannel, cl_mem d_transformed, int outputChannel, cl_mem d_tiles, cl_mem d_products, cl_mem d_result, cl_uint num_events, const cl_event *wait_list, cl_event *event)
+{
+    char defines[128];
+    snprintf(defines, sizeof(defines), "-DCONV_ROW=%d -DCONV_COL=%d -DCONV_IN_CHANNEL=%d -DCONV_FILTER_SIZE=3 -DCONV_OUT_CHANNEL=%d",
+             row, col, inputChannel, outputChannel);
+    ThreadState &state = current();
+    size_t tiles_x = (col + 1) / 2;
+    size_t tiles_y = (row + 1) / 2;
+
+    // Input tiles, only this kernel waits, the other two follow on the in-order queue
+    std::string key = std::string("kernel_winograd_input_3d ") + defines;
+    cl_kernel kernel = getKernel(state, "kernel_winograd_input_3d", defines, key);
+    unsigned long long args_start = hostStart();
     checkCL(clSetKernelArg(kernel, 0, sizeof(d_m), &d_m));
     checkCL(clSetKernelArg(kernel, 1, sizeof(row), &row));
     checkCL(clSetKernelArg(kernel, 2, sizeof(col), &col));
-    checkCL(clSetKernelArg(kernel, 3, sizeof(filterSize), &filterSize));
-    checkCL(clSetKernelArg(kernel, 4, sizeof(channel), &channel));
-    checkCL(clSetKernelArg(kernel, 5, sizeof(d_result), &d_result));
+    checkCL(clSetKernelArg(kernel, 3, sizeof(inputChannel), &inputChannel));
+    checkCL(clSetKernelArg(kernel, 4, sizeof(d_tiles), &d_tiles));
+    recordHost("clSetKernelArg", args_start);
+    size_t input_global[3] = {tiles_x, tiles_y, (size_t)inputChannel};
+    enqueueKernel(state, kernel, key, 3, input_global, num_events, wait_list, NULL);
+
+    // 16 products over the channels
+    key = std::string("kernel_winograd_multiply_3d ") + defines;
+    kernel = getKernel(state, "kernel_winograd_multiply_3d", defines, key);
+    args_start = hostStart();
+    checkCL(clSetKernelArg(kernel, 0, sizeof(d_transformed), &d_transformed));
+    checkCL(clSetKernelArg(kernel, 1, sizeof(d_tiles), &d_tiles));
+    checkCL(clSetKernelArg(kernel, 2, sizeof(row), &row));
+    checkCL(clSetKernelArg(kernel, 3, sizeof(col), &col));
+    checkCL(clSetKernelArg(kernel, 4, sizeof(inputChannel), &inputChannel));
+    checkCL(clSetKernelArg(kernel, 5, sizeof(outputChannel), &outputChannel));
+    checkCL(clSetKernelArg(kernel, 6, sizeof(d_products), &d_products));
+    recordHost("clSetKernelArg", args_start);
+    size_t multiply_global[3] = {tiles_x * tiles_y, (size_t)outputChannel, 16};
+    enqueueKernel(state, kernel, key, 3, multiply_global, 0, NULL, NULL);
+
+    // Back to pixels
+    key = std::string("kernel_winograd_output_3d ") + defines;
+    kernel = getKernel(state, "kernel_winograd_output_3d", defines, key);
+    args_start = hostStart();
+    checkCL(clSetKernelArg(kernel, 0, sizeof(d_products), &d_products));
+    checkCL(clSetKernelArg(kernel, 1, sizeof(row), &row));
+    checkCL(clSetKernelArg(kernel, 2, sizeof(col), &col));
+    checkCL(clSetKernelArg(kernel, 3, sizeof(outputChannel), &outputChannel));
+    checkCL(clSetKernelArg(kernel, 4, sizeof(d_result), &d_result));
+    recordHost("clSetKernelArg", args_start);
+    size_t output_global[3] = {tiles_x, tiles_y, (size_t)outputChannel};
+    enqueueKernel(state, kernel, key, 3, output_global, 0, NULL, event);
+}
 
-    clock_t start = clock();
+size_t OpenclClient::getIm2colSize(int row, int col, int inputChannel, int filterSize)
+{
+    return sizeof(float) * inputChannel * filterSize * filterSize * row * col;
+}
 
-    // Execute the kernel over the entire range of the data set
-    checkCL(clEnqueueNDRangeKernel(queue, kernel, 1, NULL, &globalSize, &localSize, 0, NULL, NULL));
-    // Wait for the command queue to get serviced before reading back results
-    checkCL(clFinish(queue));
+void OpenclClient::launchIm2col(cl_mem d_m, int row, int col, int inputChannel, int filterSize, int outputChannel, cl_mem d_columns, cl_uint num_events, const cl_event *wait_list, cl_event *event)
+{
+    // The other convolution kernels of the program read CONV_OUT_CHANNEL, so the variant needs it to compile
+    char defines[128];
+    snprintf(defines, sizeof(defines), "-DCONV_ROW=%d -DCONV_COL=%d -DCONV_IN_CHANNEL=%d -DCONV_FILTER_SIZE=%d -DCONV_OUT_CHANNEL=%d",
+             row, col, inputChannel, filterSize, outputChannel);
+    std::string key = std::string("kernel_im2col_3d ") + defines;
+    ThreadState &state = current();
+    cl_kernel kernel = getKernel(state, "kernel_im2col_3d", defines, key);
+
+    unsigned long long args_start = hostStart();
+    checkCL(clSetKernelArg(kernel, 0, sizeof(d_m), &d_m));
+    checkCL(clSetKernelArg(kernel, 1, sizeof(row), &row));
+    checkCL(clSetKernelArg(kernel, 2, sizeof(col), &col));
+    checkCL(clSetKernelArg(kernel, 3, sizeof(inputChannel), &inputChannel));
+    checkCL(clSetKernelArg(kernel, 4, sizeof(filterSize), &filterSize));
+    checkCL(clSetKernelArg(kernel, 5, sizeof(d_columns), &d_columns));
+    recordHost("clSetKernelArg", args_start);
+
+    size_t global[3] = {(size_t)col, (size_t)row, (size_t)(inputChannel * filterSize * filterSize)};
+    enqueueKernel(state, kernel, key, 3, global, num_events, wait_list, event);
+}
 
-    // Read the results from the device
-    checkCL(clEnqueueReadBuffer(queue, d_result, CL_TRUE, 0, sizeof(float) * channel * (row / 2) * (col / 2), result, 0, NULL, NULL));
+ConvAlgorithm OpenclClient::chooseConvAlgorithm(const char *layer, int inputChannel, int filterSize, bool pooled) const
+{
+    // Overrides are "<layer>=<algorithm>" separated by commas, the last one of a layer wins
+    ConvAlgorithm chosen = CONV_ALGORITHM_COUNT;
+    size_t layer_length = strlen(layer);
+    size_t start = 0;
+    while (start < convAlgorithms.size())
+    {
+        size_t end = convAlgorithms.find(',', start);
+        end = end == std::string::npos ? convAlgorithms.size() : end;
+        if (convAlgorithms.compare(start, layer_length, layer) == 0 && start + layer_length < end && convAlgorithms[start + layer_length] == '=')
+        {
+            std::string name = convAlgorithms.substr(start + layer_length + 1, end - start - layer_length - 1);
+            int a = 0;
+            while (a < CONV_ALGORITHM_COUNT && name != conv_algorithm_names[a])
+            {
+                a++;
+            }
+            if (a == CONV_ALGORITHM_COUNT)
+            {
+                printf("Unknown convolution algorithm %s for %s\n", name.c_str(), layer);
+                _exit(1);
+            }
+            chosen = (ConvAlgorithm)a;
+        }
+        start = end + 1;
+    }
+    if (chosen == CONV_ALGORITHM_COUNT)
+    {
+        // Fusion, when enabled, keeps the full-size output out of memory altogether. Otherwise Winograd does
+        // the fewest multiplications, the GEMM pays off once the inner dimension fills its tiles
+        if (fusedConvolution && pooled)
+        {
+            chosen = CONV_FUSED;
+        }
+        else if (winograd && filterSize == 3)
+        {
+            chosen = CONV_WINOGRAD;
+        }
+        else if (inputChannel * filterSize * filterSize >= gemm_min_depth)
+        {
+            chosen = CONV_IMPLICIT_GEMM;
+        }
+        else
+        {
+            chosen = CONV_DIRECT;
+        }
+    }
 
-    clock_t end = clock();
-    printf("GPUtime: %lf ms\n", 1000.0 * (end - start) / CLOCKS_PER_SEC);
+    // Whatever this device or build cannot run is direct
+    if ((chosen == CONV_WINOGRAD && (!winograd || filterSize != 3)) || ((chosen == CONV_IM2COL || chosen == CONV_IMPLICIT_GEMM) && !gemm) ||
+        (chosen == CONV_FUSED && !pooled))
+    {
+        chosen = CONV_DIRECT;
+    }
+    return chosen;
+}
 
-    // Release OpenCL object
-    checkCL(clReleaseMemObject(d_m));
-    checkCL(clReleaseMemObject(d_result));
+const char *OpenclClient::getConvAlgorithmName(ConvAlgorithm algorithm)
+{
+    return conv_algorithm_names[algorithm];
 }
 
-void OpenclClient::launch(const char *kernel_name, float *m, int row, int col)
+void OpenclClient::launch(const char *kernel_name, float *m, int row, int col, int inputChannel, float *filter, int filterSize, int outputChannel, float *result)
 {
-    cl_kernel kernel = getKernel(kernel_name);
-    // Number of work items
-    size_t n = row * col;
+    // Upload filter only for this launch, blocking since the launch may run on another queue
+    cl_mem d_filter = acquireBuffer(sizeof(float) * outputChannel * inputChannel * filterSize * filterSize, CL_MEM_READ_ONLY);
+    writeBuffer(d_filter, filter, sizeof(float) * outputChannel * inputChannel * filterSize * filterSize);
+
+    launch(kernel_name, m, row, col, inputChannel, d_filter, filterSize, outputChannel, result);
 
-    // Number of total work items - localSize must be devisor
-    size_t grid = n / localSize + (n % localSize ? 1 : 0);
-    size_t globalSize = grid * localSize;
+    recycleBuffer(d_filter);
+}
 
+void OpenclClient::launch(const char *kernel_name, float *m, int row, int col, int inputChannel, cl_mem d_filter, int filterSize, int outputChannel, float *result)
+{
     // Create the input and output arrays in device memory for our calculation
-    cl_mem d_m = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(float) * row * col, NULL, &err);
-    checkCL(err);
+    cl_mem d_m = acquireBuffer(sizeof(float) * inputChannel * row * col, CL_MEM_READ_ONLY);
+    cl_mem d_result = acquireBuffer(sizeof(float) * outputChannel * row * col, CL_MEM_WRITE_ONLY);
 
     // Write our data set into the input array in device memory
-    checkCL(clEnqueueWriteBuffer(queue, d_m, CL_TRUE, 0, sizeof(float) * row * col, m, 0, NULL, NULL));
+    cl_event written;
+    writeBuffer(d_m, m, sizeof(float) * inputChannel * row * col, CL_FALSE, 0, NULL, &written);
 
-    // Set the arguments to our compute kernel
-    checkCL(clSetKernelArg(kernel, 0, sizeof(d_m), &d_m));
-    checkCL(clSetKernelArg(kernel, 1, sizeof(row), &row));
-    checkCL(clSetKernelArg(kernel, 2, sizeof(col), &col));
+    cl_event executed;
+    launch(kernel_name, d_m, row, col, inputChannel, d_filter, filterSize, outputChannel, d_result, 1, &written, &executed);
+    // Read the results from the device once the kernel is done
+    readBuffer(d_result, result, sizeof(float) * outputChannel * row * col, CL_TRUE, 1, &executed);
+    printKernelTime(executed);
+
+    // Release OpenCL object
+    checkCL(clReleaseEvent(written));
+    checkCL(clReleaseEvent(executed));
+    recycleBuffer(d_m);
+    recycleBuffer(d_result);
+}
 
-    clock_t start = clock();
+void OpenclClient::launch(const char *kernel_name, float *m1, int row1, int col1, float *m2, int row2, int col2, float *result, const Epilogue &epilogue)
+{
+    // Upload m1 only for this launch, blocking since the launch may run on another queue
+    cl_mem d_m1 = acquireBuffer(sizeof(float) * row1 * col1, CL_MEM_READ_ONLY);
+    writeBuffer(d_m1, m1, sizeof(float) * row1 * col1);
 
-    // Execute the kernel over the entire range of the data set
-    checkCL(clEnqueueNDRangeKernel(queue, kernel, 1, NULL, &globalSize, &localSize, 0, NULL, NULL));
-    // Wait for the command queue to get serviced before reading back results
-    checkCL(clFinish(queue));
+    launch(kernel_name, d_m1, row1, col1, m2, row2, col2, result, epilogue);
 
-    // Read the results from the device
-    checkCL(clEnqueueReadBuffer(queue, d_m, CL_TRUE, 0, sizeof(float) * row * col, m, 0, NULL, NULL));
+    recycleBuffer(d_m1);
+}
+
+void OpenclClient::launch(const char *kernel_name, cl_mem d_m1, int row1, int col1, float *m2, int row2, int col2, float *result, const Epilogue &epilogue)
+{
+    // Create the input and output arrays in device memory for our calculation
+    cl_mem d_m2 = acquireBuffer(sizeof(float) * row2 * col2, CL_MEM_READ_ONLY);
+    cl_mem d_result = acquireBuffer(sizeof(float) * row1 * col2, CL_MEM_WRITE_ONLY);
 
-    clock_t end = clock();
-    printf("GPUtime: %lf ms\n", 1000.0 * (end - start) / CLOCKS_PER_SEC);
+    // Write our data set into the input array in device memory
+    cl_event written;
+    writeBuffer(d_m2, m2, sizeof(float) * row2 * col2, CL_FALSE, 0, NULL, &written);
+
+    cl_event executed;
+    launch(kernel_name, d_m1, row1, col1, d_m2, row2, col2, d_result, epilogue, 1, &written, &executed);
+    // Read the results from the device once the kernel is done
+    readBuffer(d_result, result, sizeof(float) * row1 * col2, CL_TRUE, 1, &executed);
+    printKernelTime(executed);
 
     // Release OpenCL object
-    checkCL(clReleaseMemObject(d_m));
+    checkCL(clReleaseEvent(written));
+    checkCL(clReleaseEvent(executed));
+    recycleBuffer(d_m2);
+    recycleBuffer(d_result);
 }
 
-void OpenclClient::launch(const char *kernel_name, unsigned char *m, int row, int col, float *result)
+void OpenclClient::launch(const char *kernel_name, float *m, int row, int col, int filterSize, int channel, float *result)
 {
-    cl_kernel kernel = getKernel(kernel_name);
-    // Number of work items
-    size_t n = row * col;
+    // Create the input and output arrays in device memory for our calculation
+    cl_mem d_m = acquireBuffer(sizeof(float) * channel * row * col, CL_MEM_READ_ONLY);
+    cl_mem d_result = acquireBuffer(sizeof(float) * channel * (row / 2) * (col / 2), CL_MEM_WRITE_ONLY);
+
+    // Write our data set into the input array in device memory
+    cl_event written;
+    writeBuffer(d_m, m, sizeof(float) * channel * row * col, CL_FALSE, 0, NULL, &written);
 
-    // Number of total work items - localSize must be devisor
-    size_t grid = n / localSize + (n % localSize ? 1 : 0);
-    size_t globalSize = grid * localSize;
+    cl_event executed;
+    launch(kernel_name, d_m, row, col, filterSize, channel, d_result, 1, &written, &executed);
+    // Read the results from the device once the kernel is done
+    readBuffer(d_result, result, sizeof(float) * channel * (row / 2) * (col / 2), CL_TRUE, 1, &executed);
+    printKernelTime(executed);
 
+    // Release OpenCL object
+    checkCL(clReleaseEvent(written));
+    checkCL(clReleaseEvent(executed));
+    recycleBuffer(d_m);
+    recycleBuffer(d_result);
+}
+
+void OpenclClient::launch(const char *kernel_name, float *m, int row, int col)
+{
     // Create the input and output arrays in device memory for our calculation
-    cl_mem d_m = clCreateBuffer(context, CL_MEM_READ_ONLY, 3 * sizeof(unsigned char) * row * col, NULL, &err); // Input image is 3 channel
-    checkCL(err);
-    cl_mem d_result = clCreateBuffer(context, CL_MEM_WRITE_ONLY, sizeof(float) * row * col, NULL, &err); // Output image is 1 channel
-    checkCL(err);
+    cl_mem d_m = acquireBuffer(sizeof(float) * row * col, CL_MEM_READ_WRITE);
 
     // Write our data set into the input array in device memory
-    checkCL(clEnqueueWriteBuffer(queue, d_m, CL_TRUE, 0, 3 * sizeof(unsigned char) * row * col, m, 0, NULL, NULL));
+    cl_event written;
+    writeBuffer(d_m, m, sizeof(float) * row * col, CL_FALSE, 0, NULL, &written);
 
-    // Set the arguments to our compute kernel
-    checkCL(clSetKernelArg(kernel, 0, sizeof(d_m), &d_m));
-    checkCL(clSetKernelArg(kernel, 1, sizeof(row), &row));
-    checkCL(clSetKernelArg(kernel, 2, sizeof(col), &col));
-    checkCL(clSetKernelArg(kernel, 3, sizeof(d_result), &d_result));
+    cl_event executed;
+    launch(kernel_name, d_m, row, col, 1, &written, &executed);
+    // Read the results from the device once the kernel is done
+    readBuffer(d_m, m, sizeof(float) * row * col, CL_TRUE, 1, &executed);
+    printKernelTime(executed);
 
-    clock_t start = clock();
+    // Release OpenCL object
+    checkCL(clReleaseEvent(written));
+    checkCL(clReleaseEvent(executed));
+    recycleBuffer(d_m);
+}
 
-    // Execute the kernel over the entire range of the data set
-    checkCL(clEnqueueNDRangeKernel(queue, kernel, 1, NULL, &globalSize, &localSize, 0, NULL, NULL));
-    // Wait for the command queue to get serviced before reading back results
-    checkCL(clFinish(queue));
+void OpenclClient::launch(const char *kernel_name, unsigned char *m, int row, int col, float *result)
+{
+    // Create the input and output arrays in device memory for our calculation
+    cl_mem d_m = acquireBuffer(3 * sizeof(unsigned char) * row * col, CL_MEM_READ_ONLY); // Input image is 3 channel
+    cl_mem d_result = acquireBuffer(sizeof(float) * row * col, CL_MEM_WRITE_ONLY);       // Output image is 1 channel
 
-    // Read the results from the device
-    checkCL(clEnqueueReadBuffer(queue, d_result, CL_TRUE, 0, sizeof(float) * row * col, result, 0, NULL, NULL));
+    // Write our data set into the input array in device memory
+    cl_event written;
+    writeBuffer(d_m, m, 3 * sizeof(unsigned char) * row * col, CL_FALSE, 0, NULL, &written);
 
-    clock_t end = clock();
-    printf("GPUtime: %lf ms\n", 1000.0 * (end - start) / CLOCKS_PER_SEC);
+    cl_event executed;
+    launch(kernel_name, d_m, row, col, d_result, 1, &written, &executed);
+    // Read the results from the device once the kernel is done
+    readBuffer(d_result, result, sizeof(float) * row * col, CL_TRUE, 1, &executed);
+    printKernelTime(executed);
 
     // Release OpenCL object
-    checkCL(clReleaseMemObject(d_m));
-    checkCL(clReleaseMemObject(d_result));
-}
\ No newline at end of file
+    checkCL(clReleaseEvent(written));
+    checkCL(clReleaseEvent(executed));
+    recycleBuffer(d_m);
+    recycleBuffer(d_result);
+}
@@ -1,33 +1,231 @@
 #ifndef __MY_OPENCL_H__
 #define __MY_OPENCL_H__
 
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 #include <CL/opencl.h>
+#include "Autotuner.hpp"
+#include "BufferPool.hpp"
+#include "DeviceList.hpp"
+#include "Metrics.hpp"
+#include "Profiler.hpp"
+#include "ProgramCache.hpp"
 
-class OpenclClient // Wrapper class of OpenCL
+enum ZeroCopyMode
+{
+    ZERO_COPY_AUTO, // on when the device shares memory with the host
+    ZERO_COPY_OFF,
+    ZERO_COPY_ON
+};
+
+enum ConvAlgorithm
+{
+    CONV_DIRECT,        // kernel_convolution_3d, tiled when the device has room
+    CONV_WINOGRAD,      // Winograd F(2x2, 3x3), 3x3 filters only
+    CONV_IM2COL,        // kernel_im2col_3d into scratch, then kernel_gemm_3d
+    CONV_IMPLICIT_GEMM, // kernel_convolution_gemm_3d, kernel_gemm_3d without the scratch
+    CONV_FUSED,         // kernel_convolution_relu_*_pool_3d, ReLU and 2x2 pooling in the same launch
+    CONV_ALGORITHM_COUNT
+};
+
+enum EpilogueActivation
+{
+    EPILOGUE_NONE,
+    EPILOGUE_RELU
+};
+
+struct Epilogue // applied by multiplication kernels to each result element before the store
+{
+    cl_mem bias;                   // added to every element of a result row, NULL for none
+    float scale;                   // multiplies the product before the bias
+    EpilogueActivation activation; // applied last
+
+    Epilogue(EpilogueActivation activation = EPILOGUE_NONE, cl_mem bias = NULL, float scale = 1);
+};
+
+struct OpenclOptions
+{
+    size_t poolLimit;            // max bytes of idle buffers kept for reuse
+    bool transferQueues;         // uploads and readbacks get their own queues
+    bool profiling;              // queues record event timestamps
+    ZeroCopyMode zeroCopy;       // map host-backed buffers instead of copying
+    const char *programCacheDir; // directory of compiled program binaries, NULL disables the cache
+    bool specialize;             // build per-shape kernel variants with the shape as constants
+    bool tiledConvolution;       // convolve through local memory tiles when the device has room
+    bool winograd;               // 3x3 convolutions through Winograd F(2x2, 3x3) where it is within tolerance
+    bool fusedConvolution;       // a conv layer followed by ReLU and 2x2 pooling runs as one direct kernel, off by default
+    const char *convAlgorithms;  // per-layer overrides such as "conv1=direct,conv2=im2col", NULL picks by shape
+    bool autotune;               // time local sizes of untuned kernels on their first launch
+    const char *tuningDir;       // directory of per-device tuning files, NULL keeps results in memory
+    const char *device;          // device index, type or name, NULL picks the fastest
+    const char *profileFile;     // record every command for writeProfile(), implies profiling
+    const char *traceFile;       // record host calls and commands for writeTrace(), implies profiling
+    bool metrics;                // aggregate latencies and counters, implies profiling
+    const char *metricsFile;     // where main writes the metrics, NULL for none
+
+    OpenclOptions();
+    void loadEnvironment();
+};
+
+// Wrapper class of OpenCL. Threads may share a client: context, programs, weights and the buffer pool are shared,
+// every thread gets its own queues and kernel objects, so arguments set by one thread never reach another's launch
+class OpenclClient
 {
 private:
-    cl_int err;                // OpenCL error code
-    cl_platform_id cpPlatform; // OpenCL platform
-    cl_device_id device_id;    // device ID
-    cl_context context;        // context
-    cl_command_queue queue;    // command queue
-    cl_program program;        // program
+    struct ThreadState // Queues and kernels of one calling thread
+    {
+        cl_command_queue queue;         // command queue for kernels
+        cl_command_queue uploadQueue;   // command queue for writes, may be queue
+        cl_command_queue downloadQueue; // command queue for reads, may be queue
+        std::string layer;              // layer recorded commands belong to
+
+        std::unordered_map<std::string, cl_kernel> kernels; // generic by kernel name, specialized by name and build options
+        std::vector<cl_kernel> ownedKernels;                // every created kernel, kernels may hold one several times
+        std::map<std::string, LocalSize> localSizes;        // resolved local size by kernel name and shape
+    };
+
+    cl_platform_id cpPlatform;      // OpenCL platform
+    cl_device_id device_id;         // device ID
+    DeviceInfo deviceInfo;          // selected device
+    cl_context context;             // context
+    bool transferQueues;            // uploads and readbacks get their own queues
+    bool profiling;                 // queues record event timestamps
+    Profiler *profiler;             // recorded commands and host calls, NULL unless profileFile or traceFile is set
+    Metrics *metrics;               // aggregates, NULL when disabled
+    bool zeroCopy;                  // host-backed buffers are mapped in place
+    cl_program program;             // program
+    ProgramCache *programCache;     // compiled program binaries
+    double programLoadMs;           // time to build or load program
+    bool programFromCache;          // program was loaded from a cached binary
+    std::string kernelSource;       // source of program, rebuilt for specialized variants
+    bool specialize;                // build per-shape kernel variants
+    bool tiledConvolution;          // kernel_convolution_3d launches run kernel_convolution_tiled_3d
+    bool winograd;                  // registerWinogradWeight() transforms filters
+    bool gemm;                      // device runs the GEMM kernels, kernel_multiply and direct convolution otherwise
+    bool gemv;                      // single-column multiplications run kernel_gemv
+    bool fusedConvolution;          // chooseConvAlgorithm() fuses pooled layers
+    std::string convAlgorithms;     // per-layer overrides, empty for none
+
+    std::map<std::string, cl_program> specializedPrograms; // by build options, NULL when the build failed
 
-    cl_kernel *kernels;        // kernels
-    const char **kernel_names; // kernel names
-    size_t kernel_count;       // kernel count
+    std::vector<cl_mem> weights;              // device-resident weights
+    std::map<cl_mem, cl_mem> winogradWeights; // transformed filter by filter, NULL when out of tolerance
+    BufferPool *pool;                         // recycled temporary buffers
 
-    size_t localSize; // OpenCL local size
+    size_t localSize; // OpenCL local size of untuned 1D launches
+    Autotuner *tuner; // tuned local sizes of this device
+    bool autotune;    // tune missing entries on first launch
 
-    cl_kernel getKernel(const char *kernel_name);
+    unsigned long long instanceId;                    // tells clients apart in the per-thread lookup cache
+    std::map<std::thread::id, ThreadState *> threads; // every thread using the client, until it calls releaseThreadState()
+    std::mutex mutex;                                 // guards threads, weights, pool, profiler and metrics
+    std::mutex buildMutex;                            // guards specialized programs and the tuner
+    static thread_local unsigned long long cachedId;  // client whose state the calling thread looked up last
+    static thread_local ThreadState *cachedState;     // and its state
+
+    ThreadState &current();
+    ThreadState *createThreadState();
+    void destroyThreadState(ThreadState *state);
+    void finishAll();
+    void addKernels(ThreadState &state, cl_program kernel_program, const std::string &suffix);
+    cl_program getVariant(const char *defines);
+    cl_kernel getKernel(ThreadState &state, const char *kernel_name, const char *defines, const std::string &key);
+    bool checkWinograd(cl_mem filter, cl_mem transformed, int row, int col, int inputChannel, int outputChannel);
+    LocalSize resolveLocalSize(ThreadState &state, cl_kernel kernel, const std::string &key, cl_uint dims, const size_t *global, cl_uint num_events, const cl_event *wait_list);
+    LocalSize tuneLocalSize(ThreadState &state, cl_kernel kernel, const std::string &key, cl_uint dims, const size_t *global);
+    cl_event *commandEvent(cl_event *event, cl_event *own);
+    void countMetric(MetricCounter counter, unsigned long long value);
+    unsigned long long hostStart() const;
+    void recordHost(const char *name, unsigned long long start);
+    void recordCommand(const char *type, const std::string &name, size_t bytes, cl_event *event, cl_event *own, unsigned long long start);
+    void printKernelTime(cl_event executed);
+    bool fitsDevice(cl_kernel kernel);
+    void enqueueKernel(ThreadState &state, cl_kernel kernel, const std::string &key, cl_uint dims, const size_t *global, cl_uint num_events, const cl_event *wait_list, cl_event *event);
 
 public:
     const char *kernel_file_name;
 
-    OpenclClient(const char *file_name, size_t localSize);
+    OpenclClient(const char *file_name, size_t localSize, const OpenclOptions &options = OpenclOptions());
     ~OpenclClient();
+    // Frees the queues and kernels of the calling thread, a later call from it starts afresh. Otherwise they stay
+    // until the client is deleted: long-lived clients serving short-lived threads must call this as a thread ends
+    void releaseThreadState();
+    cl_mem registerWeight(const float *weight, size_t count);
+    void releaseWeight(cl_mem weight);
+
+    // Device buffers, launches on them are only enqueued and never wait.
+    // Each takes an optional wait list and returns an event the caller must release or wait().
+    // With transferQueues, writes, launches and reads run on different queues
+    // and only wait lists order them. Commands go to the calling thread's queues
+    cl_mem createBuffer(size_t size, cl_mem_flags flags, void *host_ptr = NULL);
+    void releaseBuffer(cl_mem buffer);
+    void writeBuffer(cl_mem buffer, const void *data, size_t size, cl_bool blocking = CL_TRUE, cl_uint num_events = 0, const cl_event *wait_list = NULL, cl_event *event = NULL);
+    void readBuffer(cl_mem buffer, void *data, size_t size, cl_bool blocking = CL_TRUE, cl_uint num_events = 0, const cl_event *wait_list = NULL, cl_event *event = NULL);
+    // Maps go to the kernel queue, or with upload to the upload queue where only wait lists order them with kernels
+    void *mapBuffer(cl_mem buffer, size_t size, cl_map_flags flags, cl_bool blocking = CL_TRUE, cl_uint num_events = 0, const cl_event *wait_list = NULL, cl_event *event = NULL, bool upload = false);
+    void unmapBuffer(cl_mem buffer, void *mapped, cl_uint num_events = 0, const cl_event *wait_list = NULL, cl_event *event = NULL, bool upload = false);
+    cl_mem createSubBuffer(cl_mem buffer, size_t offset, size_t size);
+    size_t getBaseAlignment();
+    cl_mem acquireBuffer(size_t size, cl_mem_flags flags);
+    void recycleBuffer(cl_mem buffer);
+    void trimPool(size_t bytes);
+    BufferPoolStats getPoolStats();
+    void sync(); // commands of the calling thread
+    void wait(cl_event event);
+    bool isProfiling() const;
+    bool isZeroCopy() const;
+    double getProgramLoadMs() const;
+    bool isProgramFromCache() const;
+    size_t getTunedCount();
+    // Specialized builds that failed so far, the shape of each one runs the generic kernels
+    size_t getFailedVariantCount();
+    const DeviceInfo &getDeviceInfo() const;
+    void getEventTimes(cl_event event, cl_ulong *start, cl_ulong *end);
+    // Recorded commands are tagged with the layer the calling thread set last, the writes wait for all threads.
+    // Recording goes on until resetProfile()
+    void setLayer(const char *name);
+    bool writeProfile(const char *path);
+    bool writeTrace(const char *path);
+    void resetProfile();
+
+    // Aggregates since the last reset, a snapshot waits for recorded commands. Empty when metrics are off
+    MetricsSnapshot getMetrics();
+    void resetMetrics();
+    bool writeMetrics(const char *path);
+    void launch(const char *kernel_name, cl_mem m, int row, int col, int inputChannel, cl_mem filter, int filterSize, int outputChannel, cl_mem result, cl_uint num_events = 0, const cl_event *wait_list = NULL, cl_event *event = NULL);
+    void launch(const char *kernel_name, cl_mem m1, int row1, int col1, cl_mem m2, int row2, int col2, cl_mem result, cl_uint num_events = 0, const cl_event *wait_list = NULL, cl_event *event = NULL);
+    void launch(const char *kernel_name, cl_mem m1, int row1, int col1, cl_mem m2, int row2, int col2, cl_mem result, const Epilogue &epilogue, cl_uint num_events = 0, const cl_event *wait_list = NULL, cl_event *event = NULL);
+    void launch(const char *kernel_name, cl_mem m, int row, int col, int filterSize, int channel, cl_mem result, cl_uint num_events = 0, const cl_event *wait_list = NULL, cl_event *event = NULL);
+    void launch(const char *kernel_name, cl_mem m, int row, int col, cl_uint num_events = 0, const cl_event *wait_list = NULL, cl_event *event = NULL);
+    void launch(const char *kernel_name, cl_mem m, int row, int col, cl_mem result, cl_uint num_events = 0, const cl_event *wait_list = NULL, cl_event *event = NULL);
+
+    // Winograd F(2x2, 3x3) convolution, for 3x3 filters with stride 1 and padding 1.
+    // The filter is transformed once, NULL when Winograd is off or differs from the direct kernel beyond tolerance.
+    // tiles and products are scratch buffers of the get*Size() bytes
+    cl_mem registerWinogradWeight(cl_mem filter, int row, int col, int inputChannel, int outputChannel);
+    static size_t getWinogradTilesSize(int row, int col, int inputChannel);
+    static size_t getWinogradProductsSize(int row, int col, int outputChannel);
+    void launchWinograd(cl_mem m, int row, int col, int inputChannel, cl_mem transformed, int outputChannel, cl_mem tiles, cl_mem products, cl_mem result, cl_uint num_events = 0, const cl_event *wait_list = NULL, cl_event *event = NULL);
+
+    // Convolution as a GEMM of the filter (outputChannel x inputChannel * filterSize^2) and the im2col columns
+    // (inputChannel * filterSize^2 x row * col), which launchIm2col() writes to a scratch buffer of getIm2colSize() bytes.
+    // kernel_gemm_3d is the GEMM, kernel_convolution_gemm_3d does both without the scratch
+    static size_t getIm2colSize(int row, int col, int inputChannel, int filterSize);
+    void launchIm2col(cl_mem m, int row, int col, int inputChannel, int filterSize, int outputChannel, cl_mem columns, cl_uint num_events = 0, const cl_event *wait_list = NULL, cl_event *event = NULL);
+    // Algorithm of the named conv layer: its override if any, else fused if enabled and pooled says ReLU and 2x2 pooling
+    // follow, Winograd for 3x3 filters, GEMM for deep ones and direct otherwise
+    ConvAlgorithm chooseConvAlgorithm(const char *layer, int inputChannel, int filterSize, bool pooled) const;
+    static const char *getConvAlgorithmName(ConvAlgorithm algorithm);
+
+    // Host arrays, each launch waits for its result
     void launch(const char *kernel_name, float *m, int row, int col, int inputChannel, float *filter, int filterSize, int outputChannel, float *result);
-    void launch(const char *kernel_name, float *m1, int row1, int col1, float *m2, int row2, int col2, float *result);
+    void launch(const char *kernel_name, float *m, int row, int col, int inputChannel, cl_mem filter, int filterSize, int outputChannel, float *result);
+    void launch(const char *kernel_name, float *m1, int row1, int col1, float *m2, int row2, int col2, float *result, const Epilogue &epilogue = Epilogue());
+    void launch(const char *kernel_name, cl_mem m1, int row1, int col1, float *m2, int row2, int col2, float *result, const Epilogue &epilogue = Epilogue());
     void launch(const char *kernel_name, float *m, int row, int col, int filterSize, int channel, float *result);
     void launch(const char *kernel_name, float *m, int row, int col);
     void launch(const char *kernel_name, unsigned char *m, int row, int col, float *result);
@@ -0,0 +1,17 @@
+#ifndef __OPENCL_CHECK_H__
+#define __OPENCL_CHECK_H__
+
+#include <stdio.h>
+#include <unistd.h>
+
+#define checkCL(expression)                                                  \
+    {                                                                        \
+        cl_int cl_err = (expression);                                        \
+        if (cl_err < 0 && cl_err > -64)                                      \
+        {                                                                    \
+            printf("Error on line %d (error code: %d)\n", __LINE__, cl_err); \
+            _exit(0);                                                        \
+        }                                                                    \
+    }
+
+#endif
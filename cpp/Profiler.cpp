@@ -0,0 +1,249 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+#include "Profiler.hpp"
+#include "OpenclCheck.hpp"
+
+// Per layer totals of its commands, in milliseconds
+struct LayerTimes
+{
+    std::string layer;
+    int commands;
+    double queueMs;    // queued to start, waiting in the queue and for dependencies
+    double transferMs; // start to end of writes, reads, maps and unmaps
+    double kernelMs;   // start to end of kernels
+};
+
+// Commands and host spans kept each, older ones are dropped so long runs stay bounded
+static const size_t record_limit = 1 << 16;
+
+Profiler::Profiler()
+    : harvested(0), droppedRecords(0), droppedSpans(0)
+{
+}
+
+Profiler::~Profiler()
+{
+    clear();
+}
+
+unsigned long long Profiler::hostNs()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+double wallTimeMs()
+{
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return now.tv_sec * 1000.0 + now.tv_usec / 1000.0;
+}
+
+void Profiler::record(const std::string &layer, const char *type, const std::string &name, size_t bytes, cl_event event)
+{
+    CommandRecord command = {layer, type, name, bytes, event, hostNs(), {0, 0, 0, 0}};
+    checkCL(clRetainEvent(event));
+    records.push_back(command);
+    harvest(false);
+
+    if (records.size() > record_limit)
+    {
+        if (records.front().event != NULL)
+        {
+            checkCL(clReleaseEvent(records.front().event));
+        }
+        records.pop_front();
+        harvested = harvested > 0 ? harvested - 1 : 0;
+        droppedRecords++;
+    }
+}
+
+void Profiler::recordHost(const std::string &layer, const char *name, unsigned long long start, unsigned long long end)
+{
+    // Calls come from the thread that made them, each thread gets its own trace track
+    std::map<std::thread::id, int>::iterator found = threadIndices.find(std::this_thread::get_id());
+    if (found == threadIndices.end())
+    {
+        found = threadIndices.insert(std::make_pair(std::this_thread::get_id(), (int)threadIndices.size())).first;
+    }
+    HostSpan span = {layer, name, found->second, start, end};
+    spans.push_back(span);
+    if (spans.size() > record_limit)
+    {
+        spans.pop_front();
+        droppedSpans++;
+    }
+}
+
+void Profiler::harvest(bool wait)
+{
+    // Timestamps of completed commands in enqueue order, their events are released
+    const cl_profiling_info params[4] = {CL_PROFILING_COMMAND_QUEUED, CL_PROFILING_COMMAND_SUBMIT, CL_PROFILING_COMMAND_START, CL_PROFILING_COMMAND_END};
+    while (harvested < records.size())
+    {
+        CommandRecord &command = records[harvested];
+        cl_int status;
+        if (wait)
+        {
+            checkCL(clWaitForEvents(1, &command.event));
+        }
+        checkCL(clGetEventInfo(command.event, CL_EVENT_COMMAND_EXECUTION_STATUS, sizeof(status), &status, NULL));
+        if (status != CL_COMPLETE)
+        {
+            break;
+        }
+        for (int j = 0; j < 4; j++)
+        {
+            checkCL(clGetEventProfilingInfo(command.event, params[j], sizeof(unsigned long long), &command.times[j], NULL));
+        }
+        checkCL(clReleaseEvent(command.event));
+        command.event = NULL;
+        harvested++;
+    }
+}
+
+void Profiler::clear()
+{
+    for (size_t i = harvested; i < records.size(); i++)
+    {
+        checkCL(clReleaseEvent(records[i].event));
+    }
+    records.clear();
+    spans.clear();
+    harvested = 0;
+    droppedRecords = 0;
+    droppedSpans = 0;
+}
+
+bool Profiler::write(const char *path)
+{
+    FILE *file_handle = fopen(path, "w");
+    if (file_handle == NULL)
+    {
+        return false;
+    }
+
+    // Timestamps relative to the first queued command
+    harvest(true);
+    unsigned long long origin = 0;
+    for (size_t i = 0; i < records.size(); i++)
+    {
+        origin = i == 0 || records[i].times[0] < origin ? records[i].times[0] : origin;
+    }
+
+    // Layers in order of their first command
+    std::vector<LayerTimes> layers;
+    for (size_t i = 0; i < records.size(); i++)
+    {
+        size_t l = 0;
+        while (l < layers.size() && layers[l].layer != records[i].layer)
+        {
+            l++;
+        }
+        if (l == layers.size())
+        {
+            LayerTimes layer = {records[i].layer, 0, 0, 0, 0};
+            layers.push_back(layer);
+        }
+        const unsigned long long *t = records[i].times;
+        double queue_ms = (t[2] - t[0]) / 1e6;
+        double run_ms = (t[3] - t[2]) / 1e6;
+        layers[l].commands++;
+        layers[l].queueMs += queue_ms;
+        (strcmp(records[i].type, "kernel") == 0 ? layers[l].kernelMs : layers[l].transferMs) += run_ms;
+    }
+
+    size_t length = strlen(path);
+    if (length > 4 && strcmp(path + length - 4, ".csv") == 0)
+    {
+        fprintf(file_handle, "layer,commands,queue_ms,transfer_ms,kernel_ms\n");
+        for (size_t l = 0; l < layers.size(); l++)
+        {
+            fprintf(file_handle, "%s,%d,%.6f,%.6f,%.6f\n", layers[l].layer.c_str(), layers[l].commands,
+                    layers[l].queueMs, layers[l].transferMs, layers[l].kernelMs);
+        }
+    }
+    else
+    {
+        fprintf(file_handle, "{\n  \"dropped_commands\": %zu,\n  \"layers\": [\n", droppedRecords);
+        for (size_t l = 0; l < layers.size(); l++)
+        {
+            fprintf(file_handle, "    {\"layer\": \"%s\", \"commands\": %d, \"queue_ms\": %.6f, \"transfer_ms\": %.6f, \"kernel_ms\": %.6f}%s\n",
+                    layers[l].layer.c_str(), layers[l].commands, layers[l].queueMs, layers[l].transferMs, layers[l].kernelMs,
+                    l + 1 < layers.size() ? "," : "");
+        }
+        fprintf(file_handle, "  ],\n  \"commands\": [\n");
+        for (size_t i = 0; i < records.size(); i++)
+        {
+            const unsigned long long *t = records[i].times;
+            fprintf(file_handle, "    {\"layer\": \"%s\", \"type\": \"%s\", \"name\": \"%s\", \"bytes\": %zu, "
+                                 "\"queued_ns\": %llu, \"submit_ns\": %llu, \"start_ns\": %llu, \"end_ns\": %llu}%s\n",
+                    records[i].layer.c_str(), records[i].type, records[i].name.c_str(), records[i].bytes,
+                    t[0] - origin, t[1] - origin, t[2] - origin, t[3] - origin,
+                    i + 1 < records.size() ? "," : "");
+        }
+        fprintf(file_handle, "  ]\n}\n");
+    }
+    return fclose(file_handle) == 0;
+}
+
+bool Profiler::writeTrace(const char *path)
+{
+    FILE *file_handle = fopen(path, "w");
+    if (file_handle == NULL)
+    {
+        return false;
+    }
+
+    // Device clock to host clock: an enqueue returns after its command is queued,
+    // so the smallest host - queued difference is the closest estimate of the offset
+    harvest(true);
+    long long offset = 0;
+    for (size_t i = 0; i < records.size(); i++)
+    {
+        long long difference = (long long)(records[i].hostNs - records[i].times[0]);
+        offset = i == 0 || difference < offset ? difference : offset;
+    }
+    unsigned long long origin = 0;
+    for (size_t i = 0; i < spans.size(); i++)
+    {
+        origin = i == 0 || spans[i].start < origin ? spans[i].start : origin;
+    }
+    for (size_t i = 0; i < records.size(); i++)
+    {
+        unsigned long long queued = records[i].times[0] + offset;
+        origin = (i == 0 && spans.empty()) || queued < origin ? queued : origin;
+    }
+
+    // Host calls on one track per thread, device commands on one track per queue kind, timestamps in microseconds
+    fprintf(file_handle, "{\"otherData\": {\"dropped_commands\": %zu, \"dropped_host_calls\": %zu},\n\"traceEvents\": [\n", droppedRecords, droppedSpans);
+    fprintf(file_handle, "  {\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 1, \"args\": {\"name\": \"host\"}},\n");
+    for (size_t t = 0; t < threadIndices.size(); t++)
+    {
+        fprintf(file_handle, "  {\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %zu, \"args\": {\"name\": \"thread %zu\"}},\n", t + 1, t);
+    }
+    fprintf(file_handle, "  {\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 2, \"args\": {\"name\": \"device\"}},\n");
+    fprintf(file_handle, "  {\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 2, \"tid\": 1, \"args\": {\"name\": \"kernels\"}},\n");
+    fprintf(file_handle, "  {\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 2, \"tid\": 2, \"args\": {\"name\": \"uploads\"}},\n");
+    fprintf(file_handle, "  {\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 2, \"tid\": 3, \"args\": {\"name\": \"readbacks\"}}");
+    for (size_t i = 0; i < spans.size(); i++)
+    {
+        fprintf(file_handle, ",\n  {\"name\": \"%s\", \"cat\": \"host\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f, \"args\": {\"layer\": \"%s\"}}",
+                spans[i].name, spans[i].thread + 1, (spans[i].start - origin) / 1e3, (spans[i].end - spans[i].start) / 1e3, spans[i].layer.c_str());
+    }
+    for (size_t i = 0; i < records.size(); i++)
+    {
+        const unsigned long long *t = records[i].times;
+        int track = strcmp(records[i].type, "write") == 0 ? 2 : strcmp(records[i].type, "read") == 0 ? 3 : 1;
+        const char *name = records[i].name.empty() ? records[i].type : records[i].name.c_str();
+        fprintf(file_handle, ",\n  {\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"X\", \"pid\": 2, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f, "
+                             "\"args\": {\"layer\": \"%s\", \"bytes\": %zu, \"queue_us\": %.3f}}",
+                name, records[i].type, track, (t[2] + offset - origin) / 1e3, (t[3] - t[2]) / 1e3,
+                records[i].layer.c_str(), records[i].bytes, (t[2] - t[0]) / 1e3);
+    }
+    fprintf(file_handle, "\n]}\n");
+    return fclose(file_handle) == 0;
+}
@@ -0,0 +1,60 @@
+#ifndef __PROFILER_H__
+#define __PROFILER_H__
+
+#include <deque>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+#include <CL/opencl.h>
+
+struct CommandRecord
+{
+    std::string layer;           // layer the command belongs to
+    const char *type;            // "write", "read", "map", "unmap" or "kernel"
+    std::string name;            // kernel name and shape, empty for transfers
+    size_t bytes;                // bytes moved, 0 for kernels
+    cl_event event;              // retained until the command completes, NULL once times holds its timestamps
+    unsigned long long hostNs;   // host time the enqueue returned, aligns device and host clocks
+    unsigned long long times[4]; // QUEUED, SUBMIT, START and END in device nanoseconds
+};
+
+struct HostSpan
+{
+    std::string layer;        // layer set when the call was made
+    const char *name;         // OpenCL call, e.g. "clSetKernelArg"
+    int thread;               // index of the calling thread, in order of first recorded call
+    unsigned long long start; // host time in nanoseconds
+    unsigned long long end;
+};
+
+class Profiler // Device timestamps of the latest recorded commands and the host calls around them
+{
+private:
+    std::deque<CommandRecord> records;            // oldest first, at most record_limit
+    std::deque<HostSpan> spans;                   // oldest first, at most record_limit
+    size_t harvested;                             // records before this one hold their timestamps
+    size_t droppedRecords;                        // oldest records dropped to stay within the limit
+    size_t droppedSpans;
+    std::map<std::thread::id, int> threadIndices; // threads that recorded host calls
+
+    void harvest(bool wait);
+
+public:
+    Profiler();
+    ~Profiler();
+    static unsigned long long hostNs();
+    void record(const std::string &layer, const char *type, const std::string &name, size_t bytes, cl_event event);
+    void recordHost(const std::string &layer, const char *name, unsigned long long start, unsigned long long end);
+    // The writes wait for recorded commands, false if the file can't be written.
+    // JSON per command and per layer, or CSV per layer if path ends in .csv
+    bool write(const char *path);
+    // Chrome trace-event JSON of host calls and device commands on one timeline, for Perfetto or chrome://tracing
+    bool writeTrace(const char *path);
+    void clear();
+};
+
+// Wall-clock milliseconds, for timing host code outside the profiler
+double wallTimeMs();
+
+#endif
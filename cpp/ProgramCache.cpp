@@ -0,0 +1,191 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <vector>
+#include "ProgramCache.hpp"
+#include "OpenclCheck.hpp"
+
+// Header in front of every cached binary
+struct CacheHeader
+{
+    char magic[8];               // "CLBIN01"
+    unsigned long long key;      // makeKey() of the entry
+    unsigned long long size;     // binary size in bytes
+    unsigned long long checksum; // fnv1a() of the binary
+};
+
+static const char cache_magic[8] = "CLBIN01";
+
+static unsigned long long fnv1a(const void *data, size_t size, unsigned long long hash = 1469598103934665603ULL)
+{
+    const unsigned char *bytes = (const unsigned char *)data;
+    for (size_t i = 0; i < size; i++)
+    {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static std::string deviceString(cl_device_id device_id, cl_device_info param)
+{
+    size_t size;
+    checkCL(clGetDeviceInfo(device_id, param, 0, NULL, &size));
+    std::vector<char> value(size + 1, '\0');
+    checkCL(clGetDeviceInfo(device_id, param, size, &value[0], NULL));
+    return std::string(&value[0]);
+}
+
+ProgramCache::ProgramCache(const char *directory)
+    : directory(directory != NULL ? directory : "")
+{
+    if (!this->directory.empty() && mkdir(directory, 0755) != 0 && errno != EEXIST)
+    {
+        printf("Program cache disabled, can't create %s\n", directory);
+        this->directory.clear();
+    }
+}
+
+std::string ProgramCache::entryPath(unsigned long long key) const
+{
+    char name[32];
+    snprintf(name, sizeof(name), "/%016llx.bin", key);
+    return directory + name;
+}
+
+unsigned long long ProgramCache::makeKey(cl_device_id device_id, const char *source, size_t size, const char *options) const
+{
+    // A new driver or device must never load an old binary
+    std::string device = deviceString(device_id, CL_DEVICE_NAME) + '\n' +
+                         deviceString(device_id, CL_DEVICE_VERSION) + '\n' +
+                         deviceString(device_id, CL_DRIVER_VERSION) + '\n';
+    unsigned long long key = fnv1a(source, size);
+    key = fnv1a(options != NULL ? options : "", options != NULL ? strlen(options) : 0, fnv1a("\n", 1, key));
+    return fnv1a(device.c_str(), device.size(), fnv1a("\n", 1, key));
+}
+
+cl_program ProgramCache::load(cl_context context, cl_device_id device_id, unsigned long long key, const char *options)
+{
+    FILE *file_handle = fopen(entryPath(key).c_str(), "rb");
+    if (file_handle == NULL)
+    {
+        return NULL;
+    }
+
+    CacheHeader header;
+    std::vector<unsigned char> binary;
+    bool valid = fread(&header, sizeof(header), 1, file_handle) == 1 &&
+                 memcmp(header.magic, cache_magic, sizeof(cache_magic)) == 0 &&
+                 header.key == key && header.size > 0;
+    if (valid)
+    {
+        binary.resize(header.size);
+        valid = fread(&binary[0], 1, header.size, file_handle) == header.size &&
+                fnv1a(&binary[0], binary.size()) == header.checksum;
+    }
+    fclose(file_handle);
+    if (!valid)
+    {
+        printf("Program cache entry %016llx is corrupt, rebuilding\n", key);
+        return NULL;
+    }
+
+    // The driver may still reject a binary, e.g. after an update with the same version string
+    const unsigned char *binaries[1] = {&binary[0]};
+    size_t lengths[1] = {binary.size()};
+    cl_int status, err;
+    cl_program program = clCreateProgramWithBinary(context, 1, &device_id, lengths, binaries, &status, &err);
+    if (program == NULL || err != CL_SUCCESS || status != CL_SUCCESS)
+    {
+        printf("Program cache entry %016llx rejected by the driver, rebuilding\n", key);
+        if (program != NULL)
+        {
+            clReleaseProgram(program);
+        }
+        return NULL;
+    }
+    if (clBuildProgram(program, 1, &device_id, options, NULL, NULL) != CL_SUCCESS)
+    {
+        printf("Program cache entry %016llx failed to build, rebuilding\n", key);
+        clReleaseProgram(program);
+        return NULL;
+    }
+    return program;
+}
+
+void ProgramCache::store(cl_program program, unsigned long long key)
+{
+    size_t size;
+    checkCL(clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES, sizeof(size), &size, NULL));
+    if (size == 0)
+    {
+        return;
+    }
+    std::vector<unsigned char> binary(size);
+    unsigned char *binaries[1] = {&binary[0]};
+    checkCL(clGetProgramInfo(program, CL_PROGRAM_BINARIES, sizeof(binaries), binaries, NULL));
+
+    CacheHeader header;
+    memcpy(header.magic, cache_magic, sizeof(cache_magic));
+    header.key = key;
+    header.size = size;
+    header.checksum = fnv1a(&binary[0], size);
+
+    // Write to a temporary file and rename, so a crash never leaves a half-written entry
+    std::string path = entryPath(key);
+    std::string temp_path = path + ".tmp";
+    FILE *file_handle = fopen(temp_path.c_str(), "wb");
+    if (file_handle == NULL)
+    {
+        return;
+    }
+    bool written = fwrite(&header, sizeof(header), 1, file_handle) == 1 &&
+                   fwrite(&binary[0], 1, size, file_handle) == size;
+    written = fclose(file_handle) == 0 && written;
+    if (!written || rename(temp_path.c_str(), path.c_str()) != 0)
+    {
+        remove(temp_path.c_str());
+    }
+}
+
+cl_program ProgramCache::build(cl_context context, cl_device_id device_id, const char *source, size_t size, const char *options, bool *from_cache)
+{
+    unsigned long long key = 0;
+    if (!directory.empty())
+    {
+        key = makeKey(device_id, source, size, options);
+        cl_program program = load(context, device_id, key, options);
+        if (program != NULL)
+        {
+            *from_cache = true;
+            return program;
+        }
+    }
+    *from_cache = false;
+
+    // Create the compute program from the source buffer
+    cl_int err;
+    cl_program program = clCreateProgramWithSource(context, 1, &source, &size, &err);
+    checkCL(err);
+
+    // Build the program executable
+    err = clBuildProgram(program, 1, &device_id, options, NULL, NULL);
+    if (err != CL_SUCCESS)
+    {
+        size_t log_size;
+        clGetProgramBuildInfo(program, device_id, CL_PROGRAM_BUILD_LOG, 0, NULL, &log_size);
+        char *file_log = new char[log_size];
+        clGetProgramBuildInfo(program, device_id, CL_PROGRAM_BUILD_LOG, log_size, file_log, NULL);
+        printf("%s\n", file_log);
+        delete[] file_log;
+        clReleaseProgram(program);
+        return NULL;
+    }
+
+    if (!directory.empty())
+    {
+        store(program, key);
+    }
+    return program;
+}
@@ -0,0 +1,23 @@
+#ifndef __PROGRAM_CACHE_H__
+#define __PROGRAM_CACHE_H__
+
+#include <string>
+#include <CL/opencl.h>
+
+class ProgramCache // Compiled program binaries on disk, keyed by source, options and device
+{
+private:
+    std::string directory; // empty when disabled
+
+    std::string entryPath(unsigned long long key) const;
+    unsigned long long makeKey(cl_device_id device_id, const char *source, size_t size, const char *options) const;
+    cl_program load(cl_context context, cl_device_id device_id, unsigned long long key, const char *options);
+    void store(cl_program program, unsigned long long key);
+
+public:
+    ProgramCache(const char *directory);
+    // Loads the cached binary or builds from source and caches it, NULL if the source fails to build
+    cl_program build(cl_context context, cl_device_id device_id, const char *source, size_t size, const char *options, bool *from_cache);
+};
+
+#endif
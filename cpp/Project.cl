@@ -6,6 +6,14 @@ __kernel void kernel_convolution(__global float *m, int row, int col, int inputC
                                  __global float *filter, int filterSize, int outputChannel,
                                  __global float *result)
 {
+#ifdef CONV_ROW
+    // Shape fixed at build time, loops unroll and indexing folds into constants
+    row = CONV_ROW;
+    col = CONV_COL;
+    inputChannel = CONV_IN_CHANNEL;
+    filterSize = CONV_FILTER_SIZE;
+    outputChannel = CONV_OUT_CHANNEL;
+#endif
     int globalId = get_global_id(0);
     if (globalId >= outputChannel * row * col)
         return;
@@ -37,10 +45,383 @@ __kernel void kernel_convolution(__global float *m, int row, int col, int inputC
     }
 }
 
+// result[nowOutChannel][i][j] of a convolution with zero padding, kernels summing in this order match bit for bit
+float convolutionAt(__global float *m, int row, int col, int inputChannel,
+                    __global float *filter, int filterSize, int nowOutChannel, int i, int j)
+{
+    __global float *nowFilter = filter + nowOutChannel * inputChannel * filterSize * filterSize; // filter[nowOutChannel]
+    float sum = 0;
+    for (int nowInChannel = 0; nowInChannel < inputChannel; nowInChannel++)
+    {
+        __global float *input = m + nowInChannel * row * col; // m[nowInChannel]
+        for (int a = 0; a < filterSize; a++)
+        {
+            int convRow = i + a - filterSize / 2;
+            if (convRow < 0 || convRow >= row) // zero padding adds nothing
+                continue;
+            for (int b = 0; b < filterSize; b++)
+            {
+                int convCol = j + b - filterSize / 2;
+                if (convCol < 0 || convCol >= col)
+                    continue;
+                sum += input[convRow * col + convCol] * nowFilter[(nowInChannel * filterSize + a) * filterSize + b];
+            }
+        }
+    }
+    return sum;
+}
+
+// 3D range: x = column, y = row, z = output channel, no division to recover the position
+__kernel void kernel_convolution_3d(__global float *m, int row, int col, int inputChannel,
+                                    __global float *filter, int filterSize, int outputChannel,
+                                    __global float *result)
+{
+#ifdef CONV_ROW
+    row = CONV_ROW;
+    col = CONV_COL;
+    inputChannel = CONV_IN_CHANNEL;
+    filterSize = CONV_FILTER_SIZE;
+    outputChannel = CONV_OUT_CHANNEL;
+#endif
+    int j = get_global_id(0);
+    int i = get_global_id(1);
+    int nowOutChannel = get_global_id(2);
+    if (j >= col || i >= row || nowOutChannel >= outputChannel)
+        return;
+
+    result[(nowOutChannel * row + i) * col + j] = convolutionAt(m, row, col, inputChannel, filter, filterSize, nowOutChannel, i, j); // result[nowOutChannel][i][j]
+}
+
+// Output tile of a work-group: CONV_TILE x CONV_TILE pixels of CONV_TILE_OUTPUTS channels
+#define CONV_TILE 8
+#define CONV_TILE_OUTPUTS 4
+#define CONV_TILE_INPUTS 8      // input channels staged in local memory at a time
+#define CONV_TILE_MAX_FILTER 3  // larger filters use kernel_convolution_3d
+#define CONV_TILE_SPAN (CONV_TILE + CONV_TILE_MAX_FILTER - 1)
+
+// 3D range like kernel_convolution_3d. The work-group loads its input tile with the halo and its filter slice
+// into local memory once per CONV_TILE_INPUTS channels, so every input pixel is read from global memory
+// once per group instead of filterSize * filterSize * outputChannel times
+__kernel __attribute__((reqd_work_group_size(CONV_TILE, CONV_TILE, CONV_TILE_OUTPUTS)))
+void kernel_convolution_tiled_3d(__global float *m, int row, int col, int inputChannel,
+                                 __global float *filter, int filterSize, int outputChannel,
+                                 __global float *result)
+{
+#ifdef CONV_ROW
+    row = CONV_ROW;
+    col = CONV_COL;
+    inputChannel = CONV_IN_CHANNEL;
+    filterSize = CONV_FILTER_SIZE;
+    outputChannel = CONV_OUT_CHANNEL;
+#endif
+    __local float tile[CONV_TILE_INPUTS][CONV_TILE_SPAN][CONV_TILE_SPAN];
+    __local float filterTile[CONV_TILE_OUTPUTS][CONV_TILE_INPUTS][CONV_TILE_MAX_FILTER * CONV_TILE_MAX_FILTER];
+
+    int j = get_global_id(0);
+    int i = get_global_id(1);
+    int nowOutChannel = get_global_id(2);
+    int localJ = get_local_id(0);
+    int localI = get_local_id(1);
+    int localOut = get_local_id(2);
+
+    // Every work-item helps loading, even those past the edge, and all of them reach the barriers
+    int loader = (localOut * CONV_TILE + localI) * CONV_TILE + localJ;
+    int loaders = CONV_TILE * CONV_TILE * CONV_TILE_OUTPUTS;
+    int span = CONV_TILE + filterSize - 1;
+    int tileRow = get_group_id(1) * CONV_TILE - filterSize / 2; // tile[][0][0] in m, halo included
+    int tileCol = get_group_id(0) * CONV_TILE - filterSize / 2;
+    int firstOut = get_group_id(2) * CONV_TILE_OUTPUTS;
+    int filterArea = filterSize * filterSize;
+
+    float sum = 0;
+    for (int firstIn = 0; firstIn < inputChannel; firstIn += CONV_TILE_INPUTS)
+    {
+        int inputs = min(CONV_TILE_INPUTS, inputChannel - firstIn);
+
+        // Input tile plus halo, zero padding outside the image
+        for (int k = loader; k < inputs * span * span; k += loaders)
+        {
+            int c = k / (span * span);
+            int y = k % (span * span) / span;
+            int x = k % span;
+            int convRow = tileRow + y;
+            int convCol = tileCol + x;
+            tile[c][y][x] = convRow < 0 || convRow >= row || convCol < 0 || convCol >= col ? 0 : m[((firstIn + c) * row + convRow) * col + convCol];
+        }
+        // filter[firstOut + o][firstIn + c] of the group's output channels
+        for (int k = loader; k < CONV_TILE_OUTPUTS * inputs * filterArea; k += loaders)
+        {
+            int o = k / (inputs * filterArea);
+            int c = k / filterArea % inputs;
+            int ab = k % filterArea;
+            filterTile[o][c][ab] = firstOut + o < outputChannel ? filter[((firstOut + o) * inputChannel + firstIn + c) * filterArea + ab] : 0;
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+
+        for (int c = 0; c < inputs; c++)
+        {
+            for (int a = 0; a < filterSize; a++)
+            {
+                for (int b = 0; b < filterSize; b++)
+                {
+                    sum += tile[c][localI + a][localJ + b] * filterTile[localOut][c][a * filterSize + b];
+                }
+            }
+        }
+        // The next channels overwrite the tile
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    if (j < col && i < row && nowOutChannel < outputChannel)
+        result[(nowOutChannel * row + i) * col + j] = sum; // result[nowOutChannel][i][j]
+}
+
+#define FUSED_POOL 2 // pooling window of the fused kernels
+
+// kernel_convolution_3d, kernel_relu and kernel_avg_pooling_3d with a FUSED_POOL window in one launch:
+// a work-item convolves the window of its pooled output in registers and writes only the average.
+// 3D range: x = pooled column, y = pooled row, z = output channel
+__kernel void kernel_convolution_relu_avg_pool_3d(__global float *m, int row, int col, int inputChannel,
+                                                  __global float *filter, int filterSize, int outputChannel,
+                                                  __global float *result)
+{
+#ifdef CONV_ROW
+    row = CONV_ROW;
+    col = CONV_COL;
+    inputChannel = CONV_IN_CHANNEL;
+    filterSize = CONV_FILTER_SIZE;
+    outputChannel = CONV_OUT_CHANNEL;
+#endif
+    int outRow = row / FUSED_POOL;
+    int outCol = col / FUSED_POOL;
+    int j = get_global_id(0);
+    int i = get_global_id(1);
+    int nowOutChannel = get_global_id(2);
+    if (j >= outCol || i >= outRow || nowOutChannel >= outputChannel)
+        return;
+
+    float sum = 0;
+    for (int a = 0; a < FUSED_POOL; a++)
+    {
+        for (int b = 0; b < FUSED_POOL; b++)
+        {
+            float value = convolutionAt(m, row, col, inputChannel, filter, filterSize, nowOutChannel, i * FUSED_POOL + a, j * FUSED_POOL + b);
+            sum += value < 0 ? 0 : value;
+        }
+    }
+    result[(nowOutChannel * outRow + i) * outCol + j] = sum / (FUSED_POOL * FUSED_POOL); // result[nowOutChannel][i][j]
+}
+
+// kernel_convolution_relu_avg_pool_3d with kernel_max_pooling_3d instead
+__kernel void kernel_convolution_relu_max_pool_3d(__global float *m, int row, int col, int inputChannel,
+                                                  __global float *filter, int filterSize, int outputChannel,
+                                                  __global float *result)
+{
+#ifdef CONV_ROW
+    row = CONV_ROW;
+    col = CONV_COL;
+    inputChannel = CONV_IN_CHANNEL;
+    filterSize = CONV_FILTER_SIZE;
+    outputChannel = CONV_OUT_CHANNEL;
+#endif
+    int outRow = row / FUSED_POOL;
+    int outCol = col / FUSED_POOL;
+    int j = get_global_id(0);
+    int i = get_global_id(1);
+    int nowOutChannel = get_global_id(2);
+    if (j >= outCol || i >= outRow || nowOutChannel >= outputChannel)
+        return;
+
+    float maxValue = 0;
+    for (int a = 0; a < FUSED_POOL; a++)
+    {
+        for (int b = 0; b < FUSED_POOL; b++)
+        {
+            float value = convolutionAt(m, row, col, inputChannel, filter, filterSize, nowOutChannel, i * FUSED_POOL + a, j * FUSED_POOL + b);
+            value = value < 0 ? 0 : value;
+            if ((a == 0 && b == 0) || value > maxValue)
+                maxValue = value;
+        }
+    }
+    result[(nowOutChannel * outRow + i) * outCol + j] = maxValue; // result[nowOutChannel][i][j]
+}
+
+// Winograd F(2x2, 3x3) for 3x3 filters with stride 1 and padding 1: a 2x2 output tile is
+// A^T [(G g G^T) .* (B^T d B)] A over the 4x4 input tile d around it, 16 multiplies instead of 36.
+// Transformed filters and tiles are stored by position xi = 0..15 of the 4x4 tile, so the products
+// are 16 independent matrix multiplications over the channels
+
+// transformed[xi][nowOutChannel][nowInChannel] = (G g G^T)[xi], run once per filter
+__kernel void kernel_winograd_filter(__global float *filter, int inputChannel, int outputChannel, __global float *transformed)
+{
+#ifdef CONV_ROW
+    inputChannel = CONV_IN_CHANNEL;
+    outputChannel = CONV_OUT_CHANNEL;
+#endif
+    int globalId = get_global_id(0);
+    if (globalId >= outputChannel * inputChannel)
+        return;
+
+    __global float *g = filter + globalId * 9; // filter[nowOutChannel][nowInChannel]
+    float gg[4][3];                            // G g
+    for (int b = 0; b < 3; b++)
+    {
+        gg[0][b] = g[b];
+        gg[1][b] = 0.5f * (g[b] + g[3 + b] + g[6 + b]);
+        gg[2][b] = 0.5f * (g[b] - g[3 + b] + g[6 + b]);
+        gg[3][b] = g[6 + b];
+    }
+    int channels = outputChannel * inputChannel;
+    for (int a = 0; a < 4; a++)
+    {
+        transformed[(a * 4 + 0) * channels + globalId] = gg[a][0];
+        transformed[(a * 4 + 1) * channels + globalId] = 0.5f * (gg[a][0] + gg[a][1] + gg[a][2]);
+        transformed[(a * 4 + 2) * channels + globalId] = 0.5f * (gg[a][0] - gg[a][1] + gg[a][2]);
+        transformed[(a * 4 + 3) * channels + globalId] = gg[a][2];
+    }
+}
+
+// 3D range: x = tile column, y = tile row, z = input channel. tiles[xi][nowInChannel][tile] = (B^T d B)[xi]
+__kernel void kernel_winograd_input_3d(__global float *m, int row, int col, int inputChannel, __global float *tiles)
+{
+#ifdef CONV_ROW
+    row = CONV_ROW;
+    col = CONV_COL;
+    inputChannel = CONV_IN_CHANNEL;
+#endif
+    int tilesX = (col + 1) / 2;
+    int tilesY = (row + 1) / 2;
+    int tileX = get_global_id(0);
+    int tileY = get_global_id(1);
+    int nowInChannel = get_global_id(2);
+    if (tileX >= tilesX || tileY >= tilesY || nowInChannel >= inputChannel)
+        return;
+
+    // 4x4 input tile starting one pixel up and left of the outputs, zero padding outside
+    __global float *input = m + nowInChannel * row * col; // m[nowInChannel]
+    float d[4][4];
+    for (int a = 0; a < 4; a++)
+    {
+        int convRow = tileY * 2 + a - 1;
+        for (int b = 0; b < 4; b++)
+        {
+            int convCol = tileX * 2 + b - 1;
+            d[a][b] = convRow < 0 || convRow >= row || convCol < 0 || convCol >= col ? 0 : input[convRow * col + convCol];
+        }
+    }
+
+    float bd[4][4]; // B^T d
+    for (int b = 0; b < 4; b++)
+    {
+        bd[0][b] = d[0][b] - d[2][b];
+        bd[1][b] = d[1][b] + d[2][b];
+        bd[2][b] = d[2][b] - d[1][b];
+        bd[3][b] = d[1][b] - d[3][b];
+    }
+    int stride = inputChannel * tilesX * tilesY;
+    __global float *out = tiles + nowInChannel * tilesX * tilesY + tileY * tilesX + tileX;
+    for (int a = 0; a < 4; a++)
+    {
+        out[(a * 4 + 0) * stride] = bd[a][0] - bd[a][2];
+        out[(a * 4 + 1) * stride] = bd[a][1] + bd[a][2];
+        out[(a * 4 + 2) * stride] = bd[a][2] - bd[a][1];
+        out[(a * 4 + 3) * stride] = bd[a][1] - bd[a][3];
+    }
+}
+
+// 3D range: x = tile, y = output channel, z = xi. products[xi] = transformed[xi] * tiles[xi] over the input channels
+__kernel void kernel_winograd_multiply_3d(__global float *transformed, __global float *tiles, int row, int col,
+                                          int inputChannel, int outputChannel, __global float *products)
+{
+#ifdef CONV_ROW
+    row = CONV_ROW;
+    col = CONV_COL;
+    inputChannel = CONV_IN_CHANNEL;
+    outputChannel = CONV_OUT_CHANNEL;
+#endif
+    int tileCount = ((row + 1) / 2) * ((col + 1) / 2);
+    int tile = get_global_id(0);
+    int nowOutChannel = get_global_id(1);
+    int xi = get_global_id(2);
+    if (tile >= tileCount || nowOutChannel >= outputChannel || xi >= 16)
+        return;
+
+    __global float *u = transformed + (xi * outputChannel + nowOutChannel) * inputChannel; // transformed[xi][nowOutChannel]
+    __global float *v = tiles + xi * inputChannel * tileCount + tile;                      // tiles[xi][0][tile]
+    float sum = 0;
+    for (int nowInChannel = 0; nowInChannel < inputChannel; nowInChannel++)
+        sum += u[nowInChannel] * v[nowInChannel * tileCount];
+    products[(xi * outputChannel + nowOutChannel) * tileCount + tile] = sum;
+}
+
+// 3D range: x = tile column, y = tile row, z = output channel. result = A^T products A, cut at odd edges
+__kernel void kernel_winograd_output_3d(__global float *products, int row, int col, int outputChannel, __global float *result)
+{
+#ifdef CONV_ROW
+    row = CONV_ROW;
+    col = CONV_COL;
+    outputChannel = CONV_OUT_CHANNEL;
+#endif
+    int tilesX = (col + 1) / 2;
+    int tilesY = (row + 1) / 2;
+    int tileX = get_global_id(0);
+    int tileY = get_global_id(1);
+    int nowOutChannel = get_global_id(2);
+    if (tileX >= tilesX || tileY >= tilesY || nowOutChannel >= outputChannel)
+        return;
+
+    int stride = outputChannel * tilesX * tilesY;
+    __global float *in = products + nowOutChannel * tilesX * tilesY + tileY * tilesX + tileX;
+    float p[4][4];
+    for (int xi = 0; xi < 16; xi++)
+        p[xi / 4][xi % 4] = in[xi * stride];
+
+    float ap[2][4]; // A^T p
+    for (int b = 0; b < 4; b++)
+    {
+        ap[0][b] = p[0][b] + p[1][b] + p[2][b];
+        ap[1][b] = p[1][b] - p[2][b] - p[3][b];
+    }
+    for (int a = 0; a < 2; a++)
+    {
+        int i = tileY * 2 + a;
+        float y0 = ap[a][0] + ap[a][1] + ap[a][2];
+        float y1 = ap[a][1] - ap[a][2] - ap[a][3];
+        if (i < row)
+        {
+            result[(nowOutChannel * row + i) * col + tileX * 2] = y0; // result[nowOutChannel][i][j]
+            if (tileX * 2 + 1 < col)
+                result[(nowOutChannel * row + i) * col + tileX * 2 + 1] = y1;
+        }
+    }
+}
+
+#define EPILOGUE_NONE 0 // EpilogueActivation in MyOpencl.hpp
+#define EPILOGUE_RELU 1
+
+// Epilogue of the multiplication kernels, applied to result[i][j] before the store:
+// activation(scale * value + bias[i]), bias may be NULL
+float applyEpilogue(float value, int i, __global float *bias, float scale, int activation)
+{
+    value *= scale;
+    if (bias != 0)
+        value += bias[i];
+    if (activation == EPILOGUE_RELU && value < 0)
+        value = 0;
+    return value;
+}
+
 __kernel void kernel_multiply(__global float *m1, int row1, int col1,
                               __global float *m2, int row2, int col2,
-                              __global float *result)
+                              __global float *result, __global float *bias, float scale, int activation)
 {
+#ifdef MUL_ROW1
+    // Shape fixed at build time
+    row1 = MUL_ROW1;
+    col1 = MUL_COL1;
+    row2 = MUL_ROW2;
+    col2 = MUL_COL2;
+#endif
     int globalId = get_global_id(0);
     if (col1 != row2 || globalId >= row1 * col2)
         return;
@@ -48,10 +429,254 @@ __kernel void kernel_multiply(__global float *m1, int row1, int col1,
     int i = globalId / col2;
     int j = globalId % col2;
     
-    int ele = i * col2 + j;
-    result[ele] = 0; // result[i][j] = 0
+    float sum = 0;
     for (int k = 0; k < col1; k++)
-        result[ele] += m1[i * col1 + k] * m2[k * col2 + j]; // result[i][j] += m1[i][k] * m2[k][j]
+        sum += m1[i * col1 + k] * m2[k * col2 + j]; // m1[i][k] * m2[k][j]
+    result[i * col2 + j] = applyEpilogue(sum, i, bias, scale, activation); // result[i][j]
+}
+
+// Result tile of a work-group: GEMM_TILE x GEMM_TILE, each work-item accumulates GEMM_BLOCK x GEMM_BLOCK of it
+// in registers, GEMM_TILE_K columns of m1 and rows of m2 are staged in local memory at a time
+#define GEMM_TILE 32
+#define GEMM_BLOCK 4
+#define GEMM_TILE_K 16
+#define GEMM_GROUP (GEMM_TILE / GEMM_BLOCK) // work-items per side of the work-group
+
+// m[i][j .. j + 3] of a rows x cols matrix, zero outside it. One vector load unless the four cross the edge
+float4 gemmLoad4(__global const float *m, int rows, int cols, int i, int j)
+{
+    float4 value = (float4)(0);
+    if (i >= rows)
+        return value;
+    __global const float *rowStart = m + i * cols;
+    if (j + 3 < cols)
+        return vload4(0, rowStart + j);
+    if (j < cols)
+        value.x = rowStart[j];
+    if (j + 1 < cols)
+        value.y = rowStart[j + 1];
+    if (j + 2 < cols)
+        value.z = rowStart[j + 2];
+    return value;
+}
+
+// result = m1 * m2 like kernel_multiply. 3D range: x = result column / GEMM_BLOCK, y = result row / GEMM_BLOCK, z = 1,
+// in whole tiles. A work-item's block is strided by GEMM_GROUP, so neighbours read neighbouring local memory
+__kernel __attribute__((reqd_work_group_size(GEMM_GROUP, GEMM_GROUP, 1)))
+void kernel_gemm_3d(__global float *m1, int row1, int col1,
+                    __global float *m2, int row2, int col2,
+                    __global float *result, __global float *bias, float scale, int activation)
+{
+#ifdef MUL_ROW1
+    row1 = MUL_ROW1;
+    col1 = MUL_COL1;
+    row2 = MUL_ROW2;
+    col2 = MUL_COL2;
+#endif
+    if (col1 != row2) // whole work-groups return, no barrier is skipped by part of one
+        return;
+
+    __local float tile1[GEMM_TILE][GEMM_TILE_K]; // m1[firstRow + r][k + c]
+    __local float tile2[GEMM_TILE_K][GEMM_TILE]; // m2[k + r][firstCol + c]
+
+    int localX = get_local_id(0);
+    int localY = get_local_id(1);
+    int firstRow = get_group_id(1) * GEMM_TILE;
+    int firstCol = get_group_id(0) * GEMM_TILE;
+    int loader = localY * GEMM_GROUP + localX;
+
+    float sum[GEMM_BLOCK][GEMM_BLOCK];
+    for (int y = 0; y < GEMM_BLOCK; y++)
+        for (int x = 0; x < GEMM_BLOCK; x++)
+            sum[y][x] = 0;
+
+    for (int k = 0; k < col1; k += GEMM_TILE_K)
+    {
+        // Four floats per load, zero outside the matrices, so edge tiles need no checks below
+        for (int t = loader; t < GEMM_TILE * GEMM_TILE_K / 4; t += GEMM_GROUP * GEMM_GROUP)
+        {
+            int r = t / (GEMM_TILE_K / 4);
+            int c = t % (GEMM_TILE_K / 4) * 4;
+            vstore4(gemmLoad4(m1, row1, col1, firstRow + r, k + c), 0, &tile1[r][c]);
+            r = t / (GEMM_TILE / 4);
+            c = t % (GEMM_TILE / 4) * 4;
+            vstore4(gemmLoad4(m2, row2, col2, k + r, firstCol + c), 0, &tile2[r][c]);
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+
+        for (int kk = 0; kk < GEMM_TILE_K; kk++)
+        {
+            float a[GEMM_BLOCK], b[GEMM_BLOCK];
+            for (int x = 0; x < GEMM_BLOCK; x++)
+            {
+                a[x] = tile1[localY + x * GEMM_GROUP][kk];
+                b[x] = tile2[kk][localX + x * GEMM_GROUP];
+            }
+            for (int y = 0; y < GEMM_BLOCK; y++)
+                for (int x = 0; x < GEMM_BLOCK; x++)
+                    sum[y][x] += a[y] * b[x];
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    for (int y = 0; y < GEMM_BLOCK; y++)
+    {
+        int i = firstRow + localY + y * GEMM_GROUP;
+        for (int x = 0; x < GEMM_BLOCK; x++)
+        {
+            int j = firstCol + localX + x * GEMM_GROUP;
+            if (i < row1 && j < col2)
+                result[i * col2 + j] = applyEpilogue(sum[y][x], i, bias, scale, activation); // result[i][j]
+        }
+    }
+}
+
+#define GEMV_GROUP 64 // work-items sharing a row of m1
+
+// result = m1 * m2 for a single column m2, where kernel_gemm_3d would leave 31 of 32 tile columns empty.
+// 1D range: GEMV_GROUP work-items per row of m1, each adds every GEMV_GROUP-th float4 of the row,
+// then the work-group adds up the partial sums in local memory
+__kernel __attribute__((reqd_work_group_size(GEMV_GROUP, 1, 1)))
+void kernel_gemv(__global float *m1, int row1, int col1,
+                 __global float *m2, int row2, int col2,
+                 __global float *result, __global float *bias, float scale, int activation)
+{
+#ifdef MUL_ROW1
+    row1 = MUL_ROW1;
+    col1 = MUL_COL1;
+    row2 = MUL_ROW2;
+    col2 = MUL_COL2;
+#endif
+    if (col1 != row2 || col2 != 1) // whole work-groups return, no barrier is skipped by part of one
+        return;
+
+    __local float partial[GEMV_GROUP];
+    int i = get_group_id(0);
+    int localId = get_local_id(0);
+
+    // m2 is a 1 x col1 row as far as the loads are concerned
+    float sum = 0;
+    for (int k = localId * 4; k < col1; k += GEMV_GROUP * 4)
+        sum += dot(gemmLoad4(m1, row1, col1, i, k), gemmLoad4(m2, 1, col1, 0, k));
+    partial[localId] = sum;
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for (int stride = GEMV_GROUP / 2; stride > 0; stride /= 2)
+    {
+        if (localId < stride)
+            partial[localId] += partial[localId + stride];
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+    if (localId == 0 && i < row1)
+        result[i] = applyEpilogue(partial[0], i, bias, scale, activation); // result[i][0]
+}
+
+// 3D range: x = column, y = row, z = (input channel, a, b) of the filter.
+// columns[nowInChannel][a][b][i][j] = m[nowInChannel][i + a - filterSize / 2][j + b - filterSize / 2], zero padded,
+// so convolution is filter (outputChannel x inputChannel * filterSize^2) times columns
+__kernel void kernel_im2col_3d(__global float *m, int row, int col, int inputChannel, int filterSize, __global float *columns)
+{
+#ifdef CONV_ROW
+    row = CONV_ROW;
+    col = CONV_COL;
+    inputChannel = CONV_IN_CHANNEL;
+    filterSize = CONV_FILTER_SIZE;
+#endif
+    int j = get_global_id(0);
+    int i = get_global_id(1);
+    int k = get_global_id(2);
+    if (j >= col || i >= row || k >= inputChannel * filterSize * filterSize)
+        return;
+
+    int nowInChannel = k / (filterSize * filterSize);
+    int convRow = i + k / filterSize % filterSize - filterSize / 2;
+    int convCol = j + k % filterSize - filterSize / 2;
+    columns[(k * row + i) * col + j] = convRow < 0 || convRow >= row || convCol < 0 || convCol >= col ? 0 : m[(nowInChannel * row + convRow) * col + convCol];
+}
+
+// kernel_gemm_3d of filter and the columns kernel_im2col_3d would write, computed while loading the tile instead.
+// 3D range: x = output pixel / GEMM_BLOCK, y = output channel / GEMM_BLOCK, z = 1, in whole tiles
+__kernel __attribute__((reqd_work_group_size(GEMM_GROUP, GEMM_GROUP, 1)))
+void kernel_convolution_gemm_3d(__global float *m, int row, int col, int inputChannel,
+                                __global float *filter, int filterSize, int outputChannel,
+                                __global float *result)
+{
+#ifdef CONV_ROW
+    row = CONV_ROW;
+    col = CONV_COL;
+    inputChannel = CONV_IN_CHANNEL;
+    filterSize = CONV_FILTER_SIZE;
+    outputChannel = CONV_OUT_CHANNEL;
+#endif
+    __local float tile1[GEMM_TILE][GEMM_TILE_K]; // filter[firstRow + r][k + c]
+    __local float tile2[GEMM_TILE_K][GEMM_TILE]; // columns[k + r][firstCol + c]
+
+    int depth = inputChannel * filterSize * filterSize;
+    int pixels = row * col;
+    int localX = get_local_id(0);
+    int localY = get_local_id(1);
+    int firstRow = get_group_id(1) * GEMM_TILE;
+    int firstCol = get_group_id(0) * GEMM_TILE;
+    int loader = localY * GEMM_GROUP + localX;
+
+    float sum[GEMM_BLOCK][GEMM_BLOCK];
+    for (int y = 0; y < GEMM_BLOCK; y++)
+        for (int x = 0; x < GEMM_BLOCK; x++)
+            sum[y][x] = 0;
+
+    for (int k = 0; k < depth; k += GEMM_TILE_K)
+    {
+        for (int t = loader; t < GEMM_TILE * GEMM_TILE_K / 4; t += GEMM_GROUP * GEMM_GROUP)
+        {
+            int r = t / (GEMM_TILE_K / 4);
+            int c = t % (GEMM_TILE_K / 4) * 4;
+            vstore4(gemmLoad4(filter, outputChannel, depth, firstRow + r, k + c), 0, &tile1[r][c]);
+        }
+
+        // columns[k + r][pixel] straight from m, gathered element by element
+        for (int t = loader; t < GEMM_TILE * GEMM_TILE_K; t += GEMM_GROUP * GEMM_GROUP)
+        {
+            int r = t / GEMM_TILE;
+            int c = t % GEMM_TILE;
+            int pixel = firstCol + c;
+            float value = 0;
+            if (k + r < depth && pixel < pixels)
+            {
+                int nowInChannel = (k + r) / (filterSize * filterSize);
+                int convRow = pixel / col + (k + r) / filterSize % filterSize - filterSize / 2;
+                int convCol = pixel % col + (k + r) % filterSize - filterSize / 2;
+                if (convRow >= 0 && convRow < row && convCol >= 0 && convCol < col)
+                    value = m[(nowInChannel * row + convRow) * col + convCol];
+            }
+            tile2[r][c] = value;
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+
+        for (int kk = 0; kk < GEMM_TILE_K; kk++)
+        {
+            float a[GEMM_BLOCK], b[GEMM_BLOCK];
+            for (int x = 0; x < GEMM_BLOCK; x++)
+            {
+                a[x] = tile1[localY + x * GEMM_GROUP][kk];
+                b[x] = tile2[kk][localX + x * GEMM_GROUP];
+            }
+            for (int y = 0; y < GEMM_BLOCK; y++)
+                for (int x = 0; x < GEMM_BLOCK; x++)
+                    sum[y][x] += a[y] * b[x];
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    for (int y = 0; y < GEMM_BLOCK; y++)
+    {
+        int nowOutChannel = firstRow + localY + y * GEMM_GROUP;
+        for (int x = 0; x < GEMM_BLOCK; x++)
+        {
+            int pixel = firstCol + localX + x * GEMM_GROUP;
+            if (nowOutChannel < outputChannel && pixel < pixels)
+                result[nowOutChannel * pixels + pixel] = sum[y][x]; // result[nowOutChannel][i][j]
+        }
+    }
 }
 
 __kernel void kernel_add(__global float *m1, int row1, int col1,
@@ -71,6 +696,13 @@ __kernel void kernel_add(__global float *m1, int row1, int col1,
 
 __kernel void kernel_avg_pooling(__global float *m, int row, int col, int filterSize, int channel, __global float *result)
 {
+#ifdef POOL_ROW
+    // Shape fixed at build time
+    row = POOL_ROW;
+    col = POOL_COL;
+    filterSize = POOL_FILTER_SIZE;
+    channel = POOL_CHANNEL;
+#endif
     int globalId = get_global_id(0);
     if (globalId >= channel * row * col)
         return;
@@ -96,8 +728,42 @@ __kernel void kernel_avg_pooling(__global float *m, int row, int col, int filter
     result[ele] /= filterSize * filterSize;
 }
 
+// 3D range over the output: x = column, y = row, z = channel
+__kernel void kernel_avg_pooling_3d(__global float *m, int row, int col, int filterSize, int channel, __global float *result)
+{
+#ifdef POOL_ROW
+    row = POOL_ROW;
+    col = POOL_COL;
+    filterSize = POOL_FILTER_SIZE;
+    channel = POOL_CHANNEL;
+#endif
+    int outRow = row / filterSize;
+    int outCol = col / filterSize;
+    int j = get_global_id(0);
+    int i = get_global_id(1);
+    int nowChannel = get_global_id(2);
+    if (j >= outCol || i >= outRow || nowChannel >= channel)
+        return;
+
+    __global float *input = m + (nowChannel * row + i * filterSize) * col + j * filterSize; // m[nowChannel][i*filterSize][j*filterSize]
+    float sum = 0;
+    for (int a = 0; a < filterSize; a++)
+    {
+        for (int b = 0; b < filterSize; b++)
+            sum += input[a * col + b];
+    }
+    result[(nowChannel * outRow + i) * outCol + j] = sum / (filterSize * filterSize);
+}
+
 __kernel void kernel_max_pooling(__global float *m, int row, int col, int filterSize, int channel, __global float *result)
 {
+#ifdef POOL_ROW
+    // Shape fixed at build time
+    row = POOL_ROW;
+    col = POOL_COL;
+    filterSize = POOL_FILTER_SIZE;
+    channel = POOL_CHANNEL;
+#endif
     int globalId = get_global_id(0);
     if (globalId >= channel * row * col)
         return;
@@ -123,8 +789,43 @@ __kernel void kernel_max_pooling(__global float *m, int row, int col, int filter
     }
 }
 
+// 3D range over the output: x = column, y = row, z = channel
+__kernel void kernel_max_pooling_3d(__global float *m, int row, int col, int filterSize, int channel, __global float *result)
+{
+#ifdef POOL_ROW
+    row = POOL_ROW;
+    col = POOL_COL;
+    filterSize = POOL_FILTER_SIZE;
+    channel = POOL_CHANNEL;
+#endif
+    int outRow = row / filterSize;
+    int outCol = col / filterSize;
+    int j = get_global_id(0);
+    int i = get_global_id(1);
+    int nowChannel = get_global_id(2);
+    if (j >= outCol || i >= outRow || nowChannel >= channel)
+        return;
+
+    __global float *input = m + (nowChannel * row + i * filterSize) * col + j * filterSize; // m[nowChannel][i*filterSize][j*filterSize]
+    float maxValue = input[0];
+    for (int a = 0; a < filterSize; a++)
+    {
+        for (int b = 0; b < filterSize; b++)
+        {
+            if (input[a * col + b] > maxValue)
+                maxValue = input[a * col + b];
+        }
+    }
+    result[(nowChannel * outRow + i) * outCol + j] = maxValue;
+}
+
 __kernel void kernel_relu(__global float *m, int row, int col)
 {
+#ifdef RELU_ROW
+    // Shape fixed at build time
+    row = RELU_ROW;
+    col = RELU_COL;
+#endif
     int globalId = get_global_id(0);
     if (globalId >= row * col)
         return;
@@ -139,6 +840,11 @@ __kernel void kernel_relu(__global float *m, int row, int col)
 
 __kernel void kernel_gray_threshold(__global unsigned char *src, int height, int width, __global float *dst)
 {
+#ifdef GRAY_HEIGHT
+    // Shape fixed at build time
+    height = GRAY_HEIGHT;
+    width = GRAY_WIDTH;
+#endif
     int globalId = get_global_id(0);
     if (globalId >= width * height)
         return;
@@ -157,3 +863,27 @@ __kernel void kernel_gray_threshold(__global unsigned char *src, int height, int
     else
         dst[pix] = 0;
 }
+
+// 3D range: x = column, y = row, z = 1 since the output has one channel
+__kernel void kernel_gray_threshold_3d(__global unsigned char *src, int height, int width, __global float *dst)
+{
+#ifdef GRAY_HEIGHT
+    height = GRAY_HEIGHT;
+    width = GRAY_WIDTH;
+#endif
+    int col = get_global_id(0);
+    int row = get_global_id(1);
+    if (col >= width || row >= height || get_global_id(2) != 0)
+        return;
+
+    int pix = row * width + col;
+    float red = src[pix * 3 + 0] * 0.2126;
+    float green = src[pix * 3 + 1] * 0.7152;
+    float blue = src[pix * 3 + 2] * 0.0722;
+    float gray = red + green + blue;
+
+    if (gray < 120)
+        dst[pix] = 1 - (gray / 255);
+    else
+        dst[pix] = 0;
+}
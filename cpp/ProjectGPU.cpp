@@ -2,11 +2,14 @@
 #include <stdlib.h>
 #include <math.h>
 #include <string.h>
-#include <sys/time.h>
 #include <time.h>
 #include <unistd.h>
+#include <thread>
+#include <vector>
 #include "MyOpencl.hpp"
 #include "ImageProcessing.hpp"
+#include "CnnModel.hpp"
+#include "MultiDevice.hpp"
 
 void printMatrix(float *m, int row, int col)
 {
@@ -20,8 +23,267 @@ void printMatrix(float *m, int row, int col)
     }
 }
 
+void reportStartup(const char *cl_file_name, const OpenclOptions &options)
+{
+    // Cold start builds from source, warm start loads the binary cached by the previous client
+    OpenclOptions cold_options = options;
+    cold_options.programCacheDir = NULL;
+    double start = wallTimeMs();
+    OpenclClient *client = new OpenclClient(cl_file_name, 64, cold_options);
+    double cold_ms = wallTimeMs() - start;
+    double cold_program_ms = client->getProgramLoadMs();
+    delete client;
+
+    delete new OpenclClient(cl_file_name, 64, options);
+
+    start = wallTimeMs();
+    client = new OpenclClient(cl_file_name, 64, options);
+    double warm_ms = wallTimeMs() - start;
+    double warm_program_ms = client->getProgramLoadMs();
+    bool from_cache = client->isProgramFromCache();
+    delete client;
+
+    printf("Startup cold: %lf ms (program build %lf ms)\n", cold_ms, cold_program_ms);
+    printf("Startup warm: %lf ms (program %s %lf ms)\n", warm_ms, from_cache ? "load" : "build", warm_program_ms);
+}
+
+void inferHost(OpenclClient &client, cl_mem d_layers[4], unsigned char *image, int width, float *sixth)
+{
+    float *grayed_img = new float[width * width]; // (28 * 28) * 1
+    client.setLayer("gray");
+    client.launch("kernel_gray_threshold", image, width, width, grayed_img);
+
+    float first[32 * 28 * 28];
+    client.setLayer("conv1");
+    client.launch("kernel_convolution", grayed_img, 28, 28, 1, d_layers[0], 3, 32, first);
+    client.launch("kernel_relu", first, 25088, 1);
+
+    float second[32 * 14 * 14];
+    client.setLayer("pool1");
+    client.launch("kernel_avg_pooling", first, 28, 28, 2, 32, second);
+
+    float third[64 * 14 * 14];
+    client.setLayer("conv2");
+    client.launch("kernel_convolution", second, 14, 14, 32, d_layers[1], 3, 64, third);
+    client.launch("kernel_relu", third, 12544, 1);
+
+    float fourth[64 * 7 * 7];
+    client.setLayer("pool2");
+    client.launch("kernel_max_pooling", third, 14, 14, 2, 64, fourth);
+
+    float fifth[256];
+    client.setLayer("linear1");
+    client.launch("kernel_gemm_3d", d_layers[2], 256, 3136, fourth, 3136, 1, fifth, Epilogue(EPILOGUE_RELU));
+
+    client.setLayer("linear2");
+    client.launch("kernel_gemm_3d", d_layers[3], 10, 256, fifth, 256, 1, sixth);
+
+    delete[] grayed_img;
+}
+
+void inferMultiDevice(const char *cl_file_name, const OpenclOptions &options, float *layers[4], const int weight_sizes[4],
+                      unsigned char *image, int width, int count, float *sixth)
+{
+    MultiDeviceExecutor executor(cl_file_name, options, layers, weight_sizes, width, width);
+    const unsigned char **images = new const unsigned char *[count];
+    float *results = new float[10 * count];
+    for (int i = 0; i < count; i++)
+    {
+        images[i] = image;
+    }
+
+    double start = wallTimeMs();
+    executor.inferBatch(images, count, results);
+    double elapsed = wallTimeMs() - start;
+    printf("Multi-device: %d images on %zu devices, %lf ms\n", count, executor.getDeviceCount(), elapsed);
+    for (size_t d = 0; d < executor.getDeviceCount(); d++)
+    {
+        printf("  %s: %d images, %lf images/ms\n", executor.getDeviceInfo(d).name.c_str(), executor.getImages(d), executor.getThroughput(d));
+    }
+
+    for (int i = 1; i < count; i++)
+    {
+        if (memcmp(results + 10 * i, results, sizeof(float) * 10) != 0)
+        {
+            printf("Result of image %d differs\n", i);
+            _exit(1);
+        }
+    }
+    memcpy(sixth, results, sizeof(float) * 10);
+    delete[] images;
+    delete[] results;
+}
+
+void inferRequests(OpenclClient *client, cl_mem *d_layers, unsigned char *image, int width, int count, float *results)
+{
+    // One request thread, its own model keeps its activations apart from the other threads
+    {
+        CnnModel model(*client, d_layers, width, width);
+        for (int i = 0; i < count; i++)
+        {
+            model.infer(image, results + 10 * i);
+        }
+    }
+    // The thread ends here, its queues and kernels would stay with the client otherwise
+    client->releaseThreadState();
+}
+
+void inferConcurrent(OpenclClient &client, cl_mem d_layers[4], unsigned char *image, int width, int thread_count, int count, float *sixth)
+{
+    // Reference from a single thread, every concurrent result has to match it bit for bit
+    CnnModel(client, d_layers, width, width).infer(image, sixth);
+
+    // 1, 2, 4 ... threads sharing the client, up to thread_count
+    std::vector<int> steps;
+    for (int threads = 1; threads < thread_count; threads *= 2)
+    {
+        steps.push_back(threads);
+    }
+    steps.push_back(thread_count);
+
+    for (size_t s = 0; s < steps.size(); s++)
+    {
+        int threads = steps[s];
+        float *results = new float[10 * threads * count];
+        std::vector<std::thread> workers;
+        double start = wallTimeMs();
+        for (int t = 0; t < threads; t++)
+        {
+            workers.push_back(std::thread(inferRequests, &client, d_layers, image, width, count, results + 10 * t * count));
+        }
+        for (int t = 0; t < threads; t++)
+        {
+            workers[t].join();
+        }
+        double elapsed = wallTimeMs() - start;
+        printf("Concurrent: %d threads, %d images, %lf ms, %lf images/ms\n", threads, threads * count, elapsed, threads * count / elapsed);
+
+        for (int i = 0; i < threads * count; i++)
+        {
+            if (memcmp(results + 10 * i, sixth, sizeof(float) * 10) != 0)
+            {
+                printf("Result of image %d on thread %d differs\n", i % count, i / count);
+                _exit(1);
+            }
+        }
+        delete[] results;
+    }
+}
+
+// Peak needs the flops one compute unit does per cycle, which OpenCL doesn't report: 0 leaves the peak out
+void benchmarkGemm(OpenclClient &client, cl_mem d_weight, int batch, int iterations, double flops_per_cu_cycle)
+{
+    // linear1 over a batch: 256 x 3136 weights times 3136 x batch activations, one column per image
+    std::vector<float> activations(3136 * batch);
+    unsigned int seed = 1;
+    for (size_t i = 0; i < activations.size(); i++)
+    {
+        seed = seed * 1103515245 + 12345;
+        activations[i] = ((seed >> 16) & 0x7fff) / 32768.0f;
+    }
+    cl_mem d_activations = client.createBuffer(sizeof(float) * activations.size(), CL_MEM_READ_ONLY);
+    cl_mem d_result = client.createBuffer(sizeof(float) * 256 * batch, CL_MEM_READ_WRITE);
+    client.writeBuffer(d_activations, activations.data(), sizeof(float) * activations.size());
+
+    const char *kernels[2] = {"kernel_multiply", "kernel_gemm_3d"};
+    std::vector<float> results[2];
+    const DeviceInfo &device = client.getDeviceInfo();
+    double flops = 2.0 * 256 * 3136 * batch;
+    double peak_gflops = (double)device.computeUnits * device.clockMhz * flops_per_cu_cycle / 1e3;
+    if (peak_gflops > 0)
+    {
+        printf("GEMM peak: %lf GFLOPS, %u compute units x %u MHz x %lf flops per compute unit cycle as given\n",
+               peak_gflops, device.computeUnits, device.clockMhz, flops_per_cu_cycle);
+    }
+    for (int k = 0; k < 2; k++)
+    {
+        // First launch builds the variant and resolves its local size, it is left out
+        client.launch(kernels[k], d_weight, 256, 3136, d_activations, 3136, batch, d_result);
+        client.sync();
+
+        double total_ms = 0;
+        for (int i = 0; i < iterations; i++)
+        {
+            cl_event executed;
+            cl_ulong start, end;
+            client.launch(kernels[k], d_weight, 256, 3136, d_activations, 3136, batch, d_result, 0, NULL, &executed);
+            client.sync();
+            client.getEventTimes(executed, &start, &end);
+            client.wait(executed);
+            total_ms += (end - start) / 1e6;
+        }
+        results[k].resize(256 * batch);
+        client.readBuffer(d_result, results[k].data(), sizeof(float) * results[k].size());
+
+        // Flops per compute unit and clock cycle compare across devices without knowing their lanes
+        double ms = total_ms / iterations;
+        double gflops = flops / ms / 1e6;
+        printf("GEMM %s: 256 x 3136 x %d, %lf ms, %lf GFLOPS, %lf flops per compute unit cycle", kernels[k], batch, ms, gflops,
+               gflops * 1e3 / ((double)device.computeUnits * device.clockMhz));
+        if (peak_gflops > 0)
+        {
+            printf(", %.2lf%% of peak", gflops / peak_gflops * 100);
+        }
+        printf("\n");
+    }
+
+    float max_error = 0;
+    for (size_t i = 0; i < results[0].size(); i++)
+    {
+        max_error = fmaxf(max_error, fabsf(results[0][i] - results[1][i]));
+    }
+    printf("GEMM max difference %g\n", max_error);
+    client.releaseBuffer(d_activations);
+    client.releaseBuffer(d_result);
+}
+
+void printPrediction(float *sixth)
+{
+    printf("Result of OCR\n");
+    printMatrix(sixth, 1, 10);
+
+    float max = sixth[0];
+    int maxIndex = 0;
+    for (int i = 1; i < 10; i++)
+    {
+        if (sixth[i] > max)
+        {
+            max = sixth[i];
+            maxIndex = i;
+        }
+    }
+    printf("Result of prediction\n%d\n", maxIndex);
+}
+
+void listAllDevices(const OpenclOptions &options)
+{
+    std::vector<DeviceInfo> devices = listDevices();
+    int selected = selectDevice(devices, options.device);
+    for (size_t i = 0; i < devices.size(); i++)
+    {
+        const DeviceInfo &device = devices[i];
+        printf("%c %zu: %s (%s, %s), %u compute units, %u MHz, %llu MB\n", (int)i == selected ? '*' : ' ', i,
+               device.name.c_str(), deviceTypeName(device.type), device.platformName.c_str(), device.computeUnits,
+               device.clockMhz, (unsigned long long)(device.globalMemSize >> 20));
+    }
+    if (devices.empty())
+    {
+        printf("No OpenCL device found\n");
+    }
+}
+
 int main(int argc, char *argv[])
 {
+    const char *mode = argc > 1 ? argv[1] : "device";
+    OpenclOptions options;
+    options.loadEnvironment();
+    if (strcmp(mode, "devices") == 0)
+    {
+        // Marks the device OPENCL_DEVICE selects, or the automatic pick
+        listAllDevices(options);
+        _exit(0);
+    }
+
     FILE *file = NULL;
     const char *weight_files[4] = {"conv1.txt", "conv2.txt", "linear1.txt", "linear2.txt"};
     int weight_sizes[4] = {32 * 1 * 3 * 3, 64 * 32 * 3 * 3, 256 * 3136, 10 * 256};
@@ -48,55 +310,155 @@ int main(int argc, char *argv[])
     const char *input_image_name = "letter.bmp";
     const char *cl_file_name = "Project.cl";
 
-    OpenclClient client(cl_file_name, 64);
+    if (strcmp(mode, "batch") == 0)
+    {
+        options.transferQueues = true;
+        options.profiling = true;
+    }
+    if (strcmp(mode, "multi") == 0)
+    {
+        options.transferQueues = true;
+    }
+    if (strcmp(mode, "host") == 0)
+    {
+        // GPUtime of each launch comes from its kernel event
+        options.profiling = true;
+    }
+    if (strcmp(mode, "gemm") == 0)
+    {
+        // Kernel times come from events
+        options.profiling = true;
+    }
+    if (strcmp(mode, "tune") == 0)
+    {
+        // Times local sizes of every launch below and saves the winners for later runs
+        options.autotune = true;
+    }
+    if (strcmp(mode, "startup") == 0)
+    {
+        reportStartup(cl_file_name, options);
+    }
 
     BMPHEADER bmpHeader;
     unsigned char *image = read_bmp(input_image_name, &bmpHeader);
-    float *grayed_img = new float[bmpHeader.biWidth * bmpHeader.biWidth]; // (28 * 28) * 1
-    client.launch("kernel_gray_threshold", image, bmpHeader.biWidth, bmpHeader.biWidth, grayed_img);
-
-    float first[32 * 28 * 28];
-    client.launch("kernel_convolution", grayed_img, 28, 28, 1, layers[0], 3, 32, first);
-    client.launch("kernel_relu", first, 25088, 1);
 
-    float second[32 * 14 * 14];
-    client.launch("kernel_avg_pooling", first, 28, 28, 2, 32, second);
+    float sixth[10];
+    if (strcmp(mode, "multi") == 0)
+    {
+        // Every device gets a replica, the batch is split by measured speed
+        int count = argc > 2 ? atoi(argv[2]) : 64;
+        inferMultiDevice(cl_file_name, options, layers, weight_sizes, image, bmpHeader.biWidth, count, sixth);
+        printPrediction(sixth);
+        _exit(0);
+    }
 
-    float third[64 * 14 * 14];
-    client.launch("kernel_convolution", second, 14, 14, 32, layers[1], 3, 64, third);
-    client.launch("kernel_relu", third, 12544, 1);
+    OpenclClient client(cl_file_name, 64, options);
+    printf("Device: %s (%s)\n", client.getDeviceInfo().name.c_str(), deviceTypeName(client.getDeviceInfo().type));
 
-    float fourth[64 * 7 * 7];
-    client.launch("kernel_max_pooling", third, 14, 14, 2, 64, fourth);
+    // Upload weights once, host copies are no longer needed after that
+    cl_mem d_layers[4];
+    for (int i = 0; i < 4; i++)
+    {
+        d_layers[i] = client.registerWeight(layers[i], weight_sizes[i]);
+        delete[] layers[i];
+    }
 
-    float fifth[256];
-    client.launch("kernel_multiply", layers[2], 256, 3136, fourth, 3136, 1, fifth);
-    client.launch("kernel_relu", fifth, 256, 1);
+    if (strcmp(mode, "host") == 0)
+    {
+        // Every layer round-trips through host memory
+        inferHost(client, d_layers, image, bmpHeader.biWidth, sixth);
 
-    float sixth[10];
-    client.launch("kernel_multiply", layers[3], 10, 256, fifth, 256, 1, sixth);
+        BufferPoolStats poolStats = client.getPoolStats();
+        printf("Buffer pool: %zu hits, %zu misses, %zu evictions, %zu bytes held\n",
+               poolStats.hits, poolStats.misses, poolStats.evictions, poolStats.bytesHeld);
+    }
+    else if (strcmp(mode, "batch") == 0)
+    {
+        // Same image many times, uploads and readbacks overlap kernels of other images
+        int count = argc > 2 ? atoi(argv[2]) : 16;
+        CnnModel model(client, d_layers, bmpHeader.biWidth, bmpHeader.biWidth, 3);
+        const unsigned char **images = new const unsigned char *[count];
+        float *results = new float[10 * count];
+        for (int i = 0; i < count; i++)
+        {
+            images[i] = image;
+        }
 
-    printf("Result of OCR\n");
-    printMatrix(sixth, 1, 10);
+        PipelineStats stats;
+        model.inferBatch(images, count, results, &stats);
+        printf("Pipeline: %d images, %lf ms wall, %lf ms transfer, %lf ms compute, %lf ms overlapped\n",
+               stats.images, stats.wallMs, stats.transferMs, stats.computeMs, stats.overlapMs);
 
-    float max = sixth[0];
-    int maxIndex = 0;
-    for (int i = 1; i < 10; i++)
+        for (int i = 1; i < count; i++)
+        {
+            if (memcmp(results + 10 * i, results, sizeof(float) * 10) != 0)
+            {
+                printf("Result of image %d differs\n", i);
+                _exit(1);
+            }
+        }
+        memcpy(sixth, results, sizeof(sixth));
+        delete[] images;
+        delete[] results;
+    }
+    else if (strcmp(mode, "gemm") == 0)
     {
-        if (sixth[i] > max)
+        // gemm [batch] [iterations] [flops per compute unit cycle]: batched linear1 through kernel_multiply and kernel_gemm_3d,
+        // batch 1 runs kernel_gemv for both. The peak of the device is printed only when its flops per cycle are given
+        int batch = argc > 2 ? atoi(argv[2]) : 64;
+        int iterations = argc > 3 ? atoi(argv[3]) : 10;
+        double flops_per_cu_cycle = argc > 4 ? atof(argv[4]) : 0;
+        if (batch <= 0 || iterations <= 0 || flops_per_cu_cycle < 0)
         {
-            max = sixth[i];
-            maxIndex = i;
+            printf("gemm needs a positive batch and iteration count and a non-negative flops per compute unit cycle\n");
+            _exit(1);
+        }
+        benchmarkGemm(client, d_layers[2], batch, iterations, flops_per_cu_cycle);
+        CnnModel(client, d_layers, bmpHeader.biWidth, bmpHeader.biWidth).infer(image, sixth);
+    }
+    else if (strcmp(mode, "stress") == 0)
+    {
+        // stress [threads] [images per thread]: one client hammered by 1, 2, 4 ... threads
+        int thread_count = argc > 2 ? atoi(argv[2]) : 8;
+        int count = argc > 3 ? atoi(argv[3]) : 16;
+        inferConcurrent(client, d_layers, image, bmpHeader.biWidth, thread_count, count, sixth);
+    }
+    else
+    {
+        // Whole chain stays on the device, one upload and one readback
+        CnnModel model(client, d_layers, bmpHeader.biWidth, bmpHeader.biWidth);
+        printf("Activation arena: %zu bytes (%zu bytes without aliasing)%s\n", model.getArenaSize(), model.getUnplannedSize(),
+               client.isZeroCopy() ? ", zero-copy" : "");
+        printf("Convolution: conv1 %s, conv2 %s\n", OpenclClient::getConvAlgorithmName(model.getConvAlgorithm(0)),
+               OpenclClient::getConvAlgorithmName(model.getConvAlgorithm(1)));
+        model.infer(image, sixth);
+        if (strcmp(mode, "tune") == 0)
+        {
+            printf("Tuning file: %zu entries\n", client.getTunedCount());
         }
     }
-    printf("Result of prediction\n%d\n", maxIndex);
 
-    for (int i = 0; i < 4; i++)
+    if (options.profileFile != NULL)
     {
-        delete[] layers[i];
+        printf("Profile %s %s\n", client.writeProfile(options.profileFile) ? "written to" : "can't be written to", options.profileFile);
+    }
+    if (options.traceFile != NULL)
+    {
+        printf("Trace %s %s\n", client.writeTrace(options.traceFile) ? "written to" : "can't be written to", options.traceFile);
     }
+    if (options.metricsFile != NULL)
+    {
+        printf("Metrics %s %s\n", client.writeMetrics(options.metricsFile) ? "written to" : "can't be written to", options.metricsFile);
+    }
+
+    if (client.getFailedVariantCount() > 0)
+    {
+        printf("Warning: %zu specialized builds failed, their shapes ran the generic kernels\n", client.getFailedVariantCount());
+    }
+
+    printPrediction(sixth);
+
     delete[] image;
-    delete[] grayed_img;
 
     _exit(0);
 }